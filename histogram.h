@@ -6,10 +6,29 @@
 #include <iostream>
 #include <array>
 #include <vector>
+#include <string>
 #include <cmath>
 #include <limits>
 #include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <thread>
+#include <tuple>
+
+#ifdef __linux__
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#include "histogram_simd.h"
+
+#ifdef HISTOGRAM_PERF_COUNTERS
+#include "histogram_perf.h"
+#endif
 
 namespace histogram {
 
@@ -17,6 +36,27 @@ namespace binning {
 
 struct dimension_tag {};
 
+namespace detail {
+
+/**
+ * @brief Bin edges and label of an axis
+ *
+ * Axes hold these through a shared pointer, so copies of an axis (and of
+ * histograms booked with it) share one immutable set of edges, and two
+ * axes with the same edges object are known to be identical.
+ */
+struct axis_data {
+	std::vector<double> edges;
+	std::string name;
+};
+
+inline std::shared_ptr<const axis_data> make_axis_data(std::vector<double> &&edges, const std::string &name)
+{
+	return std::make_shared<const axis_data>(axis_data{std::move(edges), name});
+}
+
+}
+
 /**
  * @brief A non-equispaced binning scheme
  *
@@ -30,34 +70,44 @@ public:
 	 * of bin edges, inserting under- and overflow bins as necessary
 	 */
 	general(const std::vector<double> &edges, const std::string &name=std::string())
-	    : name_(name)
 	{
+		std::vector<double> all;
+		all.reserve(edges.size()+2);
 		if (edges.front() > -std::numeric_limits<double>::infinity())
-			edges_.push_back(-std::numeric_limits<double>::infinity());
-		std::copy(edges.begin(), edges.end(), std::back_inserter(edges_));
+			all.push_back(-std::numeric_limits<double>::infinity());
+		std::copy(edges.begin(), edges.end(), std::back_inserter(all));
 		if (edges.back() < std::numeric_limits<double>::infinity())
-			edges_.push_back(std::numeric_limits<double>::infinity());
+			all.push_back(std::numeric_limits<double>::infinity());
+		data_ = detail::make_axis_data(std::move(all), name);
 	}
 	
 	/** Return the edges of the bins */
 	const std::vector<double>& edges() const
-	{ return edges_; }
+	{ return data_->edges; }
 	
-	size_t nbins() const { return edges_.size()-1; }
+	size_t nbins() const { return data_->edges.size()-1; }
 	
-	const std::string& name() const { return name_; }
+	const std::string& name() const { return data_->name; }
 	
 	size_t index(double value) const
 	{
+		const std::vector<double> &edges_ = data_->edges;
 		long j = (std::distance(edges_.begin(),
 		    std::upper_bound(edges_.begin(),
 		    edges_.end(), value)));
 		assert(j > 0);
 		return j-1;
 	}
+	
+	/** Bin indices of n values. NaN is assigned bin 0. */
+	template <typename Value>
+	void index(size_t n, const Value *values, size_t *bins) const
+	{
+		for (size_t i=0; i < n; i++)
+			bins[i] = std::isnan(values[i]) ? 0 : index(double(values[i]));
+	}
 private:
-	std::string name_;
-	std::vector<double> edges_;
+	std::shared_ptr<const detail::axis_data> data_;
 };
 
 namespace detail {
@@ -121,36 +171,96 @@ template <typename Transformation = detail::identity >
 class uniform : public dimension_tag {
 public:
 	uniform(double low, double high, size_t nbins, const std::string &name=std::string())
-	    : name_(name), offset_(Transformation::imap(low)),
+	    : offset_(Transformation::imap(low)),
 	    range_(Transformation::imap(high)-Transformation::imap(low)),
-	    min_(map(0)), max_(map(1)), nsteps_(nbins+1)
+	    min_(map(0)), max_(map(1)), nsteps_(nbins+1), low_(low), high_(high)
 	{
-		edges_.reserve(nsteps_+2);
-		edges_.push_back(-std::numeric_limits<double>::infinity());
+		std::vector<double> edges;
+		edges.reserve(nsteps_+2);
+		edges.push_back(-std::numeric_limits<double>::infinity());
 		for (size_t i = 0; i < nsteps_; i++)
-			edges_.push_back(map(i/double(nsteps_-1)));
-		edges_.push_back(std::numeric_limits<double>::infinity());
+			edges.push_back(map(i/double(nsteps_-1)));
+		edges.push_back(std::numeric_limits<double>::infinity());
+		data_ = detail::make_axis_data(std::move(edges), name);
 	}
 	
 	/** Return the edges of the bins */
 	const std::vector<double>& edges() const
-	{ return edges_; }
+	{ return data_->edges; }
 	
 	size_t nbins() const { return nsteps_ + 1; }
 	
+	/** Lower limit as given to the constructor */
+	double low() const { return low_; }
+	/** Upper limit as given to the constructor */
+	double high() const { return high_; }
+	
 	size_t index(double value) const
 	{
 		if (value < min_)
 			return 0;
 		else if (value >= max_)
-			return (edges_.size()-2);
+			return (nsteps_);
 		else {
 			return size_t(std::floor((nsteps_-1)*imap(value)))+1;
 		}
 	}
 	
+	/** Bin indices of n values. NaN is assigned bin 0. */
+	void index(size_t n, const double *values, size_t *bins) const
+	{
+		if (std::is_same<Transformation, detail::identity>::value) {
+			::histogram::detail::simd::uniform_index(n, values, min_, max_, offset_, range_,
+			    double(nsteps_-1), nsteps_, bins);
+		} else {
+			for (size_t i=0; i < n; i++)
+				bins[i] = std::isnan(values[i]) ? 0 : index(values[i]);
+		}
+	}
+	
+	/**
+	 * Bin indices of n single-precision values. NaN is assigned bin 0.
+	 *
+	 * For linear axes the indices are computed in single precision where
+	 * the rounding error is provably too small to move a value across a
+	 * bin edge, and in double precision otherwise, so that the result is
+	 * always identical to index(double).
+	 */
+	void index(size_t n, const float *values, size_t *bins) const
+	{
+		const double scale = (nsteps_-1)/range_;
+		// Bound on the error of (v - float(offset))*float(scale) in units of
+		// bins, from rounding offset, scale, and the two operations
+		const double guard = 8*std::numeric_limits<float>::epsilon()
+		    *((std::max(std::abs(min_), std::abs(max_)) + std::abs(offset_))*scale + nsteps_ + 1);
+		if (std::is_same<Transformation, detail::identity>::value && guard < 0.25) {
+			::histogram::detail::simd::uniform_index(n, values, float_threshold(min_),
+			    float_threshold(max_), float(offset_), float(scale), float(guard),
+			    nsteps_, bins);
+		} else {
+			std::fill(bins, bins+n, size_t(-1));
+		}
+		for (size_t i=0; i < n; i++)
+			if (bins[i] == size_t(-1))
+				bins[i] = std::isnan(values[i]) ? 0 : index(double(values[i]));
+	}
+	
 	const std::string& name() const
-	{ return name_; }
+	{ return data_->name; }
+	
+	/**
+	 * Whether value lands below the overflow bin of uniform(low, high,
+	 * nbins), computed as index() would without building the axis
+	 */
+	static bool below_overflow(double low, double high, size_t nbins, double value)
+	{
+		const double offset = Transformation::imap(low);
+		const double range = Transformation::imap(high) - offset;
+		if (value >= Transformation::map(range + offset))
+			return false;
+		return !(value >= Transformation::map(range*0 + offset))
+		    || std::floor(nbins*((Transformation::imap(value) - offset)/range)) < nbins;
+	}
 	
 private:
 	inline double map(double value) const
@@ -161,11 +271,18 @@ private:
 	{
 		return (Transformation::imap(value)-offset_)/range_;
 	}
+	// Smallest float f such that f >= value, so that for any float v,
+	// v < value if and only if v < f
+	static float float_threshold(double value)
+	{
+		float f = float(value);
+		return double(f) < value ? std::nextafter(f, std::numeric_limits<float>::infinity()) : f;
+	}
 	
-	std::vector<double> edges_;
-	std::string name_;
+	std::shared_ptr<const detail::axis_data> data_;
 	double offset_, range_, min_, max_;
 	size_t nsteps_;
+	double low_, high_;
 };
 
 // Convenient typedefs
@@ -176,8 +293,153 @@ typedef uniform<detail::cosine> cosine;
 template <int N>
 using power = detail::power<N>;
 
+/**
+ * @brief Bins of nearly constant relative width, 2^bits per power of two
+ *
+ * Like HdrHistogram, the bin index is read directly off the IEEE-754
+ * representation of the value: for positive doubles the bit pattern is
+ * monotonic in the value, and the exponent together with as many of
+ * the leading mantissa bits as the bits argument enumerates the bins.
+ * Finding a bin takes a shift and a subtraction, with no transcendental
+ * functions, and the width of a bin relative to its lower edge lies in
+ * (2^-(bits+1), 2^-bits] over any dynamic range.
+ *
+ * The limits are widened to the nearest bin edges, so the first edge is
+ * at or below low and the last at or above high.
+ */
+class log_linear : public dimension_tag {
+public:
+	/**
+	 * @param[in] low  lower limit; must be positive
+	 * @param[in] high upper limit
+	 * @param[in] bits log2 of the number of bins per power of two, at most 52
+	 */
+	log_linear(double low, double high, unsigned bits, const std::string &name=std::string())
+	    : low_(low), high_(high), bits_(bits), shift_(52-bits)
+	{
+		if (!(low > 0) || !(high > low) || std::isinf(high) || bits > 52)
+			throw std::invalid_argument("log_linear axis needs 0 < low < high < inf and bits <= 52");
+		first_ = key(low);
+		last_ = key(high);
+		// Extend to the edge at or above high
+		if (int64_t(uint64_t(last_) << shift_) < to_bits(high))
+			last_++;
+		min_bits_ = int64_t(uint64_t(first_) << shift_);
+		max_bits_ = int64_t(uint64_t(last_) << shift_);
+		std::vector<double> edges;
+		edges.reserve(last_ - first_ + 3);
+		edges.push_back(-std::numeric_limits<double>::infinity());
+		for (int64_t k = first_; k <= last_; k++)
+			edges.push_back(from_bits(int64_t(uint64_t(k) << shift_)));
+		edges.push_back(std::numeric_limits<double>::infinity());
+		data_ = detail::make_axis_data(std::move(edges), name);
+	}
+	
+	/** Return the edges of the bins */
+	const std::vector<double>& edges() const
+	{ return data_->edges; }
+	
+	size_t nbins() const { return size_t(last_ - first_) + 2; }
+	
+	/** Lower limit as given to the constructor */
+	double low() const { return low_; }
+	/** Upper limit as given to the constructor */
+	double high() const { return high_; }
+	/** log2 of the number of bins per power of two */
+	unsigned bits() const { return bits_; }
+	
+	const std::string& name() const { return data_->name; }
+	
+	size_t index(double value) const
+	{
+		// Negative values and -0 compare below any positive value as
+		// signed integers
+		int64_t b = to_bits(value);
+		if (b < min_bits_)
+			return 0;
+		else if (b >= max_bits_)
+			return size_t(last_ - first_) + 1;
+		else
+			return size_t((b >> shift_) - first_) + 1;
+	}
+	
+	/** Bin indices of n values. NaN is assigned bin 0. */
+	template <typename Value>
+	void index(size_t n, const Value *values, size_t *bins) const
+	{
+		for (size_t i=0; i < n; i++)
+			bins[i] = std::isnan(values[i]) ? 0 : index(double(values[i]));
+	}
+	
+private:
+	static int64_t to_bits(double value)
+	{
+		int64_t b;
+		std::memcpy(&b, &value, sizeof(b));
+		return b;
+	}
+	static double from_bits(int64_t b)
+	{
+		double value;
+		std::memcpy(&value, &b, sizeof(value));
+		return value;
+	}
+	int64_t key(double value) const { return to_bits(value) >> shift_; }
+	
+	std::shared_ptr<const detail::axis_data> data_;
+	double low_, high_;
+	unsigned bits_, shift_;
+	int64_t first_, last_, min_bits_, max_bits_;
+};
+
+/**
+ * @brief Human-readable name of a binning scheme, e.g. for diagnostics
+ */
+template <typename T>
+struct type_name;
+
+/** @cond */
+template <>
+struct type_name<general> { static std::string value() { return "general"; } };
+
+template <>
+struct type_name<linear> { static std::string value() { return "linear"; } };
+
+template <>
+struct type_name<log10> { static std::string value() { return "log10"; } };
+
+template <>
+struct type_name<cosine> { static std::string value() { return "cosine"; } };
+
+template <>
+struct type_name<log_linear> { static std::string value() { return "log_linear"; } };
+
+template <int N>
+struct type_name<uniform<detail::power<N> > > {
+	static std::string value() { return "power<" + std::to_string(N) + ">"; }
+};
+/** @endcond */
+
 }
 
+/**
+ * @brief Memory held by a histogram, in bytes
+ */
+struct memory_footprint {
+	memory_footprint() : bins(0), edges(0), strings(0), object(0) {}
+	
+	/** Bin contents and squared weights */
+	size_t bins;
+	/** Bin edges of all axes, counted in full even if shared with other histograms */
+	size_t edges;
+	/** Axis labels and title */
+	size_t strings;
+	/** The histogram object itself */
+	size_t object;
+	
+	size_t total() const { return bins + edges + strings + object; }
+};
+
 template <class... Ts>
 class histogram_impl {
 public:
@@ -189,12 +451,19 @@ public:
 
 protected:
 	// recursion endpoints
+	template <typename Visitor>
+	size_t visit_index(Visitor &, size_t) const { return 0; }
+	void index_batch(size_t, size_t *, size_t *) const {}
 	template <typename Value, size_t N>
-	void fill_shape(std::array<Value, N> &shape, size_t idx=0) const {}
+	void fill_shape(std::array<Value, N> &, size_t=0) const {}
 	template <typename Value, size_t N>
-	void fill_edges(std::array<Value, N> &shape, size_t idx=0) const {}
+	void fill_edges(std::array<Value, N> &, size_t=0) const {}
 	template <typename Value, size_t N>
-	void fill_label(std::array<Value, N> &shape, size_t idx=0) const {}
+	void fill_label(std::array<Value, N> &, size_t=0) const {}
+	void fill_memory(memory_footprint &) const {}
+	template <typename Visitor>
+	void visit_axes(Visitor &, size_t=0) const {}
+	std::tuple<> axes() const { return std::tuple<>(); }
 };
 
 template <class T, class... Ts>
@@ -216,6 +485,27 @@ protected:
 		return dimension_.index(v)*stride() + histogram_impl<Ts...>::index(tail...);
 	}
 	
+	// index(), additionally passing each axis's bin index to visitor(axis, bin, nbins)
+	template <typename Visitor, typename... Tail>
+	size_t visit_index(Visitor &visitor, size_t axis, double v, Tail...tail)
+	{
+		size_t idx = dimension_.index(v);
+		visitor(axis, idx, extent());
+		return idx*stride() + histogram_impl<Ts...>::visit_index(visitor, axis+1, tail...);
+	}
+	
+	// Add the contribution of this axis to n row-major offsets, using
+	// bins as scratch space
+	template <typename Value, typename... Tail>
+	void index_batch(size_t n, size_t *offsets, size_t *bins, const Value *v, const Tail*...tail) const
+	{
+		dimension_.index(n, v, bins);
+		const size_t step = stride();
+		for (size_t i=0; i < n; i++)
+			offsets[i] += bins[i]*step;
+		histogram_impl<Ts...>::index_batch(n, offsets, bins, tail...);
+	}
+	
 	template <typename... Tail>
 	bool valid(double v, Tail...tail)
 	{
@@ -258,29 +548,740 @@ protected:
 		shape[idx] = dimension_.name();
 		histogram_impl<Ts...>::fill_label(shape, idx+1);
 	}
+	
+	void fill_memory(memory_footprint &usage) const
+	{
+		usage.edges += dimension_.edges().capacity()*sizeof(double);
+		usage.strings += dimension_.name().capacity();
+		histogram_impl<Ts...>::fill_memory(usage);
+	}
+	
+	template <typename Visitor>
+	void visit_axes(Visitor &visitor, size_t idx=0) const
+	{
+		visitor(idx, dimension_);
+		histogram_impl<Ts...>::visit_axes(visitor, idx+1);
+	}
+	
+	std::tuple<T, Ts...> axes() const
+	{
+		return std::tuple_cat(std::tuple<T>(dimension_), histogram_impl<Ts...>::axes());
+	}
 };
 
+#ifndef HISTOGRAM_FILL_STATISTICS
+#define HISTOGRAM_FILL_STATISTICS 0
+#endif
+
 namespace detail {
 
+/**
+ * @brief Counters of rejected fills, flow-bin hits and the sum of weights
+ *
+ * Enabled by compiling with HISTOGRAM_FILL_STATISTICS=1. The disabled
+ * specialization is empty and all of its hooks are no-ops.
+ */
+template <size_t Rank, bool Enabled=HISTOGRAM_FILL_STATISTICS>
+class fill_statistics {
+public:
+	static constexpr bool enabled = true;
+	
+	fill_statistics() : n_rejected_(0), sum_weights_(0)
+	{
+		underflow_.fill(0);
+		overflow_.fill(0);
+	}
+	
+	/** Number of fills rejected because a coordinate was NaN */
+	size_t n_rejected() const { return n_rejected_; }
+	/** Sum of weights of all accepted fills */
+	double sum_weights() const { return sum_weights_; }
+	/** Number of accepted fills that landed in the first bin of each axis */
+	const std::array<size_t, Rank>& underflow() const { return underflow_; }
+	/** Number of accepted fills that landed in the last bin of each axis */
+	const std::array<size_t, Rank>& overflow() const { return overflow_; }
+	
+	void reject() { n_rejected_++; }
+	void accept(double weight) { sum_weights_ += weight; }
+	void operator()(size_t axis, size_t bin, size_t nbins)
+	{
+		underflow_[axis] += (bin == 0);
+		overflow_[axis] += (bin == nbins-1);
+	}
+	
+	/** Add the counters of another histogram */
+	void merge(const fill_statistics &other)
+	{
+		n_rejected_ += other.n_rejected_;
+		sum_weights_ += other.sum_weights_;
+		for (size_t i=0; i < Rank; i++) {
+			underflow_[i] += other.underflow_[i];
+			overflow_[i] += other.overflow_[i];
+		}
+	}
+	
+	/** Remove the counters of another histogram that were merged before */
+	void subtract(const fill_statistics &other)
+	{
+		n_rejected_ -= other.n_rejected_;
+		sum_weights_ -= other.sum_weights_;
+		for (size_t i=0; i < Rank; i++) {
+			underflow_[i] -= other.underflow_[i];
+			overflow_[i] -= other.overflow_[i];
+		}
+	}
+	
+	void clear() { *this = fill_statistics(); }
+	
+private:
+	size_t n_rejected_;
+	double sum_weights_;
+	std::array<size_t, Rank> underflow_, overflow_;
+};
+
+/** @cond */
+template <size_t Rank>
+class fill_statistics<Rank, false> {
+public:
+	static constexpr bool enabled = false;
+	
+	void reject() {}
+	void accept(double) {}
+	void operator()(size_t, size_t, size_t) {}
+	void merge(const fill_statistics &) {}
+	void subtract(const fill_statistics &) {}
+	void clear() {}
+};
+/** @endcond */
+
+/**
+ * @brief Records the bin index along each axis, forwarding to another visitor
+ */
+template <size_t Rank, typename Visitor>
+struct coordinate_recorder {
+	coordinate_recorder(Visitor &v) : visitor(v) {}
+	void operator()(size_t axis, size_t bin, size_t nbins)
+	{
+		coords[axis] = bin;
+		visitor(axis, bin, nbins);
+	}
+	Visitor &visitor;
+	std::array<size_t, Rank> coords;
+};
+
+/**
+ * @brief A read-only, strided N-dimensional view of an array
+ *
+ * Element (i_0, ..., i_{Rank-1}) is at data_[sum of i_k*strides_[k]].
+ * Views returned by histograms are row-major and contiguous; slice() and
+ * transpose() return views of the same elements that may not be. The
+ * view either refers to memory owned elsewhere or shares ownership of a
+ * buffer through owner_.
+ */
 template <typename T, size_t Rank>
 struct view {
 public:
 	view(const T *data, std::array<size_t, Rank> shape) : data_(data), shape_(shape)
+	{ strides_ = row_major_strides(); }
+	/** Take ownership of a temporary buffer */
+	view(std::vector<T> &&buffer, std::array<size_t, Rank> shape)
+	    : owner_(std::make_shared<std::vector<T> >(std::move(buffer))),
+	      data_(owner_->data()), shape_(shape)
+	{ strides_ = row_major_strides(); }
+	view(const T *data, std::array<size_t, Rank> shape, std::array<size_t, Rank> strides,
+	    std::shared_ptr<const std::vector<T> > owner=nullptr)
+	    : owner_(owner), data_(data), shape_(shape), strides_(strides)
 	{}
+	
+	/** Number of elements */
+	size_t size() const
+	{
+		size_t n = 1;
+		for (size_t k : shape_)
+			n *= k;
+		return n;
+	}
+	
+	template <typename... Index>
+	const T& operator()(Index...index) const
+	{
+		static_assert(sizeof...(Index) == Rank, "Number of indices must match rank");
+		const size_t idx[] = {size_t(index)...};
+		size_t offset = 0;
+		for (size_t i=0; i < Rank; i++)
+			offset += idx[i]*strides_[i];
+		return data_[offset];
+	}
+	
+	/**
+	 * @brief The elements with index in [begin, end) along axis
+	 * @throws std::out_of_range if the range is not within the view
+	 */
+	view slice(size_t axis, size_t begin, size_t end) const
+	{
+		if (axis >= Rank || begin > end || end > shape_[axis])
+			throw std::out_of_range("Slice out of range");
+		view sub(*this);
+		sub.data_ += begin*strides_[axis];
+		sub.shape_[axis] = end-begin;
+		return sub;
+	}
+	
+	/** @brief Exchange two axes */
+	view transpose(size_t a, size_t b) const
+	{
+		if (a >= Rank || b >= Rank)
+			throw std::out_of_range("Axis out of range");
+		view t(*this);
+		std::swap(t.shape_[a], t.shape_[b]);
+		std::swap(t.strides_[a], t.strides_[b]);
+		return t;
+	}
+	
+	/** @brief Reverse the order of the axes */
+	view transpose() const
+	{
+		view t(*this);
+		std::reverse(t.shape_.begin(), t.shape_.end());
+		std::reverse(t.strides_.begin(), t.strides_.end());
+		return t;
+	}
+	
+	/** Whether the elements are adjacent in row-major order */
+	bool is_contiguous() const
+	{
+		std::array<size_t, Rank> dense = row_major_strides();
+		for (size_t i=0; i < Rank; i++)
+			if (shape_[i] > 1 && strides_[i] != dense[i])
+				return false;
+		return true;
+	}
+	
+	/** @brief This view if it is contiguous, otherwise a contiguous copy */
+	view contiguous() const
+	{
+		if (is_contiguous())
+			return *this;
+		std::vector<T> buffer;
+		buffer.reserve(size());
+		std::array<size_t, Rank> coords;
+		coords.fill(0);
+		for (size_t n=size(), offset=0; n > 0; n--) {
+			buffer.push_back(data_[offset]);
+			for (size_t i=Rank; i > 0; i--) {
+				offset += strides_[i-1];
+				if (++coords[i-1] < shape_[i-1])
+					break;
+				offset -= shape_[i-1]*strides_[i-1];
+				coords[i-1] = 0;
+			}
+		}
+		return view(std::move(buffer), shape_);
+	}
+	
+	std::shared_ptr<const std::vector<T> > owner_;
 	const T *data_;
 	std::array<size_t, Rank> shape_;
+	std::array<size_t, Rank> strides_;
+
+private:
+	std::array<size_t, Rank> row_major_strides() const
+	{
+		std::array<size_t, Rank> strides;
+		size_t stride = 1;
+		for (size_t i=Rank; i > 0; i--) {
+			strides[i-1] = stride;
+			stride *= shape_[i-1];
+		}
+		return strides;
+	}
 };
 
 }
 
-template <class... Dimensions>
-class histogram : public histogram_impl<Dimensions...> {
+/**
+ * @brief A non-owning reference to a contiguous array
+ */
+template <typename T>
+class span {
+public:
+	typedef T element_type;
+	typedef T* iterator;
+	
+	span() : data_(nullptr), size_(0) {}
+	span(T *data, size_t size) : data_(data), size_(size) {}
+	template <typename Allocator>
+	span(const std::vector<typename std::remove_const<T>::type, Allocator> &v)
+	    : data_(v.data()), size_(v.size()) {}
+	
+	T* data() const { return data_; }
+	size_t size() const { return size_; }
+	bool empty() const { return size_ == 0; }
+	T& operator[](size_t i) const { return data_[i]; }
+	iterator begin() const { return data_; }
+	iterator end() const { return data_ + size_; }
+	
+	bool operator==(const span &other) const
+	{ return size_ == other.size_ && std::equal(begin(), end(), other.begin()); }
+	bool operator!=(const span &other) const { return !(*this == other); }
+	
+private:
+	T *data_;
+	size_t size_;
+};
+
+/**
+ * @brief Orderings of the bins in memory
+ *
+ * A layout provides a mapping<Rank> that is constructed from the shape of
+ * the histogram and translates an array of per-axis bin indices into an
+ * offset in the bin arrays.
+ */
+namespace layout {
+
+/**
+ * @brief C order, with the last axis varying fastest
+ */
+struct row_major {
+	static constexpr bool is_row_major = true;
+	
+	template <size_t Rank>
+	class mapping {
+	public:
+		mapping(const std::array<size_t, Rank> &shape) : size_(1)
+		{
+			for (size_t n : shape)
+				size_ *= n;
+		}
+		size_t size() const { return size_; }
+	private:
+		size_t size_;
+	};
+};
+
+/**
+ * @brief Bins grouped into hypercubic tiles of @f$ 2^{Bits} @f$ bins on a side
+ *
+ * Tiles are stored contiguously, so bins that are neighbours along any
+ * axis are usually within a few cache lines of each other. This helps
+ * when fills are correlated between axes.
+ *
+ * Each axis is padded to a whole number of tiles, so an axis of n bins,
+ * counting under- and overflow, takes @f$ \lceil n/2^{Bits} \rceil 2^{Bits} @f$
+ * bins of storage, and the overhead multiplies across axes: three axes of
+ * 10 bins take 16^3 rather than 12^3 bins with the default Bits, 2.4
+ * times as much, and an axis shorter than a tile costs a whole tile
+ * edge. Prefer row_major unless every axis spans several tiles.
+ * memory_usage() includes the padding.
+ *
+ * @tparam Bits log2 of the tile edge length
+ */
+template <unsigned Bits=3>
+struct tiled {
+	static constexpr bool is_row_major = false;
+	
+	template <size_t Rank>
+	class mapping {
+	public:
+		mapping(const std::array<size_t, Rank> &shape)
+		{
+			size_t tiles = 1;
+			for (size_t i=Rank; i > 0; i--) {
+				tile_stride_[i-1] = tiles;
+				tiles *= (shape[i-1] + mask) >> Bits;
+			}
+			size_ = tiles << (Bits*Rank);
+		}
+		size_t size() const { return size_; }
+		size_t offset(const std::array<size_t, Rank> &coords) const
+		{
+			size_t tile = 0, within = 0;
+			for (size_t i=0; i < Rank; i++) {
+				tile += (coords[i] >> Bits)*tile_stride_[i];
+				within = (within << Bits) | (coords[i] & mask);
+			}
+			return (tile << (Bits*Rank)) | within;
+		}
+	private:
+		static constexpr size_t mask = (size_t(1) << Bits) - 1;
+		size_t size_;
+		std::array<size_t, Rank> tile_stride_;
+	};
+};
+
+}
+
+/**
+ * @brief Tracking of which bins changed since the last delta extraction
+ *
+ * A tracking policy provides a bitmap that is constructed from the number
+ * of bins in storage and is marked with the storage offset of every bin
+ * that is written.
+ */
+namespace tracking {
+
+/**
+ * @brief No tracking
+ */
+struct none {
+	static constexpr bool enabled = false;
+	
+	class bitmap {
+	public:
+		bitmap(size_t) {}
+		void mark(size_t) {}
+		void mark_all() {}
+		void clear() {}
+	};
+};
+
+/**
+ * @brief One dirty bit per block of bins
+ *
+ * Marking a bin is a shift and an OR into a bitmap that is 1/(64*Bins)
+ * the size of the bin arrays, so it stays in cache.
+ *
+ * @tparam Bins number of bins per block; must be a power of 2
+ */
+template <size_t Bins=512>
+struct blocks {
+	static_assert(Bins > 0 && (Bins & (Bins-1)) == 0, "Block size must be a power of 2");
+	static constexpr bool enabled = true;
+	static constexpr size_t block_size = Bins;
+	
+	class bitmap {
+	public:
+		bitmap(size_t nbins)
+		    : nblocks_((nbins + Bins - 1)/Bins), words_((nblocks_ + 63)/64, 0)
+		{}
+		void mark(size_t offset)
+		{
+			size_t block = offset/Bins;
+			words_[block/64] |= uint64_t(1) << (block % 64);
+		}
+		void mark_all()
+		{
+			std::fill(words_.begin(), words_.end(), ~uint64_t(0));
+			if (nblocks_ % 64)
+				words_.back() = (uint64_t(1) << (nblocks_ % 64)) - 1;
+		}
+		void clear() { std::fill(words_.begin(), words_.end(), 0); }
+		size_t n_blocks() const { return nblocks_; }
+		/** Call f(block) for each dirty block in ascending order */
+		template <typename Function>
+		void for_each(Function &&f) const
+		{
+			for (size_t w=0; w < words_.size(); w++)
+				for (uint64_t bits = words_[w]; bits; bits &= bits-1)
+					f(w*64 + __builtin_ctzll(bits));
+		}
+	private:
+		size_t nblocks_;
+		std::vector<uint64_t> words_;
+	};
+};
+
+/** @brief Dirty bits per 64-byte cache line of bins */
+typedef blocks<8> cache_lines;
+/** @brief Dirty bits per 4 KiB page of bins */
+typedef blocks<512> pages;
+
+}
+
+/**
+ * @brief Coordination between a filling thread and concurrent readers
+ *
+ * A sync policy provides a sequence that the histogram brackets every
+ * modification with, and that readers use to take consistent copies, and
+ * the operation that adds a fill to a bin.
+ */
+namespace sync {
+
+/**
+ * @brief No coordination; readers must not run concurrently with fills
+ */
+struct none {
+	static constexpr bool enabled = false;
+	static constexpr bool concurrent_fills = false;
+	
+	static void add(double &bin, double value) { bin += value; }
+	
+	class sequence {
+	public:
+		void begin_write() {}
+		void end_write() {}
+		template <typename Function>
+		bool read(Function &&copy, size_t) const { copy(); return true; }
+	};
+};
+
+/**
+ * @brief A sequence lock for one writer and any number of readers
+ *
+ * The writer increments a counter before and after each modification, at
+ * the cost of two stores per fill. A reader copies the bins and retries
+ * if the counter was odd or changed in the meantime, so readers never
+ * block the writer. fill_batch() is a single modification, so readers
+ * of large histograms are most likely to succeed between batches.
+ */
+struct seqlock {
+	static constexpr bool enabled = true;
+	static constexpr bool concurrent_fills = false;
+	
+	static void add(double &bin, double value) { bin += value; }
+	
+	class sequence {
+	public:
+		sequence() : value_(0) {}
+		sequence(const sequence &) : value_(0) {}
+		sequence& operator=(const sequence &) { return *this; }
+		
+		void begin_write()
+		{
+			value_.store(value_.load(std::memory_order_relaxed)+1, std::memory_order_relaxed);
+			std::atomic_thread_fence(std::memory_order_release);
+		}
+		void end_write()
+		{
+			value_.store(value_.load(std::memory_order_relaxed)+1, std::memory_order_release);
+		}
+		/** Call copy() until it ran without overlapping a write, at most attempts times */
+		template <typename Function>
+		bool read(Function &&copy, size_t attempts) const
+		{
+			for (size_t i=0; i < attempts; i++) {
+				uint64_t before = value_.load(std::memory_order_acquire);
+				if ((before & 1) == 0) {
+					copy();
+					std::atomic_thread_fence(std::memory_order_acquire);
+					if (value_.load(std::memory_order_relaxed) == before)
+						return true;
+				}
+				std::this_thread::yield();
+			}
+			return false;
+		}
+	private:
+		std::atomic<uint64_t> value_;
+	};
+};
+
+/**
+ * @brief Fills from several threads or processes at once
+ *
+ * Each fill adds to its bins with a compare-and-swap loop on the bits of
+ * the doubles, so that it works on plain doubles in shared memory. Only
+ * fills, add(), += and -= are atomic; reset(), scale() and apply_delta()
+ * must not run concurrently with fills. Readers see some interleaving of
+ * the fills made so far.
+ */
+struct atomic {
+	static constexpr bool enabled = false;
+	static constexpr bool concurrent_fills = true;
+	
+	static void add(double &bin, double value)
+	{
+		uint64_t *bits = reinterpret_cast<uint64_t*>(&bin);
+		uint64_t expected = __atomic_load_n(bits, __ATOMIC_RELAXED);
+		uint64_t desired;
+		do {
+			double sum;
+			std::memcpy(&sum, &expected, sizeof(sum));
+			sum += value;
+			std::memcpy(&desired, &sum, sizeof(sum));
+		} while (!__atomic_compare_exchange_n(bits, &expected, desired, true,
+		    __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+	}
+	
+	typedef none::sequence sequence;
+};
+
+}
+
+namespace detail {
+
+/**
+ * @brief Whether an allocator maps every array of at least
+ *        discard_threshold bytes itself, privately, anonymously and with
+ *        base pages, so that pages given back with MADV_DONTNEED read as
+ *        zero afterwards
+ *
+ * This is an explicit opt-in. std::allocator does not qualify: operator
+ * new may be replaced by one that returns shared or file-backed memory.
+ */
+template <typename Allocator>
+struct discardable_pages : std::false_type {};
+
+/**
+ * @brief Storage of the entry count of a histogram whose bins come from
+ *        Allocator
+ *
+ * Allocators that keep the bins somewhere other histograms can see, like
+ * shm_allocator, specialize this to keep the count next to them.
+ */
+template <typename Allocator>
+struct entry_counter {
+	typedef size_t type;
+	static type make(const Allocator &) { return 0; }
+};
+
+/**
+ * @brief Zeroed working memory of an object that is not copied with it
+ *
+ * Callers must leave the memory zero when they are done with it.
+ */
+class scratch_buffer {
+public:
+	scratch_buffer() = default;
+	scratch_buffer(const scratch_buffer &) {}
+	scratch_buffer(scratch_buffer &&) = default;
+	scratch_buffer& operator=(const scratch_buffer &) { return *this; }
+	scratch_buffer& operator=(scratch_buffer &&) = default;
+	
+	/** At least n zeroed doubles */
+	double* zeroed(size_t n)
+	{
+		if (data_.size() < n)
+			data_.resize(n, 0.);
+		return data_.data();
+	}
+	
+	size_t bytes() const { return data_.capacity()*sizeof(double); }
+	
+private:
+	std::vector<double> data_;
+};
+
+/** Arrays smaller than this are zeroed with stores */
+constexpr size_t discard_threshold = size_t(2) << 20;
+
+/**
+ * @brief Zero an array of doubles
+ *
+ * Large arrays in discardable memory have their whole pages handed back
+ * to the kernel, which maps zero pages on the next touch, and only the
+ * partial pages at either end are written. This makes clearing a large,
+ * sparsely filled array nearly free, at the cost of a page fault per
+ * page that is filled again.
+ */
+inline void zero(double *data, size_t n, std::true_type)
+{
+#ifdef __linux__
+	if (n*sizeof(double) >= discard_threshold) {
+		const size_t page = sysconf(_SC_PAGESIZE);
+		char *begin = reinterpret_cast<char*>(data), *end = begin + n*sizeof(double);
+		char *first = reinterpret_cast<char*>((reinterpret_cast<size_t>(begin) + page-1) & ~(page-1));
+		char *last = reinterpret_cast<char*>(reinterpret_cast<size_t>(end) & ~(page-1));
+		if (first < last && madvise(first, last-first, MADV_DONTNEED) == 0) {
+			std::memset(begin, 0, first-begin);
+			std::memset(last, 0, end-last);
+			return;
+		}
+	}
+#endif
+	std::fill(data, data+n, 0.);
+}
+
+inline void zero(double *data, size_t n, std::false_type)
+{
+	std::fill(data, data+n, 0.);
+}
+
+}
+
+/**
+ * @brief A consistent copy of the bins of a histogram, in row-major order
+ */
+template <size_t Rank>
+struct histogram_snapshot {
+	size_t n_entries;
+	detail::view<double, Rank> bincontent, squaredweights;
+};
+
+/**
+ * @brief The blocks of bins that changed between two calls to
+ *        basic_histogram::extract_delta()
+ *
+ * Blocks hold absolute bin values, not differences, so applying a delta
+ * to a copy of the histogram as it was at the previous extraction brings
+ * it up to date. Offsets are in storage order, which is row-major unless
+ * the histogram has a different layout.
+ */
+struct bin_delta {
+	/** Bins per block */
+	size_t block_size;
+	/** Total number of bins in storage */
+	size_t size;
+	/** Entry count of the histogram at extraction */
+	size_t n_entries;
+	/** Indices of the blocks, in ascending order */
+	std::vector<size_t> blocks;
+	/** Contents of the blocks, concatenated; the last block of storage may be short */
+	std::vector<double> bincontent, squaredweights;
+};
+
+template<typename... Conds>
+  struct and_
+  : std::true_type
+  { };
+
+template<typename Cond, typename... Conds>
+  struct and_<Cond, Conds...>
+  : std::conditional<Cond::value, and_<Conds...>, std::false_type>::type
+  { };
+
+/**
+ * @brief Compile-time storage configuration of a histogram
+ *
+ * Derive from this and override members to change individual settings.
+ */
+struct default_traits {
+	/**
+	 * Allocator for the bin arrays. Bins are value-initialized through
+	 * the allocator, so an allocator that returns zeroed memory may make
+	 * construction a no-op. Stateful allocators are passed to the
+	 * constructor; copies of a histogram get their bins from a copy of
+	 * the allocator as chosen by select_on_container_copy_construction().
+	 */
+	typedef std::allocator<double> allocator_type;
+	/** Order of the bins in memory; see namespace layout */
+	typedef layout::row_major layout_type;
+	/** Recording of changed bins for extract_delta(); see namespace tracking */
+	typedef tracking::none tracking_type;
+	/** Coordination with concurrent readers and fillers; see namespace sync */
+	typedef sync::none sync_type;
+};
+
+template <class Traits, class... Dimensions>
+class basic_histogram : public histogram_impl<Dimensions...>,
+    private detail::fill_statistics<sizeof...(Dimensions)>,
+    private Traits::tracking_type::bitmap, private Traits::sync_type::sequence {
 public:
-	histogram(Dimensions...dims, const std::string &title=std::string())
-	    : histogram_impl<Dimensions...>(dims...), title_(title), n_entries_(0),
-	      bincontent_(this->size(), 0.), squaredweights_(this->size(), 0.)
+	typedef Traits traits_type;
+	typedef typename Traits::allocator_type allocator_type;
+	typedef typename Traits::layout_type layout_type;
+	typedef typename Traits::tracking_type tracking_type;
+	typedef typename Traits::sync_type sync_type;
+	typedef detail::fill_statistics<sizeof...(Dimensions)> statistics_type;
+	typedef histogram_snapshot<sizeof...(Dimensions)> snapshot_type;
+	
+	basic_histogram(Dimensions...dims, const std::string &title=std::string())
+	    : basic_histogram(allocator_type(), dims..., title)
+	{}
+	
+	/** @brief A histogram whose bins come from the given allocator */
+	basic_histogram(const allocator_type &allocator, Dimensions...dims, const std::string &title=std::string())
+	    : histogram_impl<Dimensions...>(dims...),
+	      tracking_type::bitmap(typename layout_type::template mapping<sizeof...(Dimensions)>(axes_shape()).size()),
+	      title_(title), shape_(axes_shape()), mapping_(shape_),
+	      bincontent_(mapping_.size(), allocator), squaredweights_(mapping_.size(), allocator),
+	      n_entries_(detail::entry_counter<allocator_type>::make(bincontent_.get_allocator()))
 	{}
 	
+	/** @brief A histogram with the same binning and title, and empty bins */
+	basic_histogram clone_empty() const
+	{ return basic_histogram(static_cast<const histogram_impl<Dimensions...>&>(*this), title_); }
+	
 	size_t ndim() const { return sizeof...(Dimensions); }
 	const std::string& title() const { return title_; }
 	void set_title (const std::string &title) { title_ = title; }
@@ -294,24 +1295,272 @@ public:
 	bool fill_with_weight(double weight, Args...args) {
 		static_assert(sizeof...(Args) == sizeof...(Dimensions), "Number of arguments must match number of dimensions");
 		
-		if (this->valid(args...)) {
-			size_t offset = this->index(args...);
-			bincontent_.at(offset) += weight;
-			squaredweights_.at(offset) += weight*weight;
-			n_entries_++;
-			return true;
-		} else {
-			return false;
+		write_section section(*this);
+		return fill_one(weight, args...);
+	}
+	
+	/**
+	 * @brief Fill entries from arrays of coordinates
+	 *
+	 * Batches of at least a few times the number of bins into
+	 * one-dimensional histograms of at most 2048 bins, counting the flow
+	 * bins, are filled through several interleaved private copies of the
+	 * bins that are summed at the end, so that runs of entries in the same
+	 * bin do not serialize on the store to that bin. The copies are kept
+	 * between calls. Other histograms of moderate size are filled 8
+	 * entries at a time with AVX-512 if the CPU supports it, fill
+	 * statistics are disabled, and the layout is row-major.
+	 *
+	 * Columns may be double or float. Bin indices of float columns are
+	 * computed in single precision where that gives the same result as
+	 * in double precision.
+	 *
+	 * @param[in] n       number of entries
+	 * @param[in] weights array of n weights, or NULL for unit weights
+	 * @param[in] columns one array of n coordinates per dimension
+	 * @returns the number of entries accepted
+	 */
+	template <typename... Columns>
+	size_t fill_batch(size_t n, const double *weights, const Columns*...columns)
+	{
+		static_assert(sizeof...(Columns) == sizeof...(Dimensions), "Number of columns must match number of dimensions");
+#ifdef HISTOGRAM_PERF_COUNTERS
+		auto counters = perf::measure(*this, "fill");
+#endif
+		write_section section(*this);
+		size_t lanes = privatized_lanes(std::integral_constant<bool, sizeof...(Dimensions) == 1>(), n);
+		if (lanes == 8)
+			return fill_privatized<8>(n, weights, columns...);
+		else if (lanes == 4)
+			return fill_privatized<4>(n, weights, columns...);
+		
+		typedef std::integral_constant<bool, !statistics_type::enabled && layout_type::is_row_major
+		    && !sync_type::concurrent_fills && and_<std::integral_constant<bool, std::is_same<Columns, double>::value
+		        || std::is_same<Columns, float>::value>...>::value> vectorizable;
+		if (vectorizable::value && detail::simd::have_avx512() && bincontent_.size() <= (size_t(1) << 18))
+			return fill_vectorized(vectorizable(), n, weights, columns...);
+		
+		size_t accepted = 0;
+		for (size_t i=0; i < n; i++)
+			accepted += fill_one(weights ? weights[i] : 1., columns[i]...);
+		return accepted;
+	}
+	
+	/**
+	 * @brief Add the contents of a histogram with the same binning
+	 *
+	 * @throws std::invalid_argument if the bin edges differ
+	 */
+	basic_histogram& operator+=(const basic_histogram &other)
+	{
+		if (!same_binning(other))
+			throw std::invalid_argument("Can't add histograms with different binning");
+		write_section section(*this);
+		for (size_t i=0; i < bincontent_.size(); i++) {
+			sync_type::add(bincontent_[i], other.bincontent_[i]);
+			sync_type::add(squaredweights_[i], other.squaredweights_[i]);
+		}
+		n_entries_ += other.n_entries_;
+		statistics_type &stats = *this;
+		stats.merge(other.statistics());
+		dirty().mark_all();
+		return *this;
+	}
+	
+	/**
+	 * @brief Remove the contents of a histogram that was added before
+	 *
+	 * @throws std::invalid_argument if the bin edges differ
+	 */
+	basic_histogram& operator-=(const basic_histogram &other)
+	{
+		if (!same_binning(other))
+			throw std::invalid_argument("Can't subtract histograms with different binning");
+		write_section section(*this);
+		for (size_t i=0; i < bincontent_.size(); i++) {
+			sync_type::add(bincontent_[i], -other.bincontent_[i]);
+			sync_type::add(squaredweights_[i], -other.squaredweights_[i]);
+		}
+		n_entries_ -= other.n_entries_;
+		statistics_type &stats = *this;
+		stats.subtract(other.statistics());
+		dirty().mark_all();
+		return *this;
+	}
+	
+	/**
+	 * @brief Add bins from row-major arrays, e.g. the contents of a
+	 *        histogram with the same binning in another process
+	 *
+	 * @param[in] n_entries      number of entries the bins represent
+	 * @param[in] bincontent     size() bin contents in row-major order
+	 * @param[in] squaredweights size() squared weights in row-major order
+	 */
+	void add(size_t n_entries, const double *bincontent, const double *squaredweights)
+	{
+		write_section section(*this);
+		add(std::integral_constant<bool, layout_type::is_row_major>(), bincontent, squaredweights);
+		n_entries_ += n_entries;
+	}
+	
+	/**
+	 * @brief Copy out the blocks of bins written since the previous call
+	 *
+	 * Only available if the traits enable tracking, e.g.
+	 * tracking::cache_lines or tracking::pages. The cost is proportional
+	 * to the number of changed blocks rather than to the number of bins.
+	 */
+	bin_delta extract_delta()
+	{
+		static_assert(tracking_type::enabled, "extract_delta() requires a tracking_type in the traits");
+		bin_delta delta;
+		delta.block_size = tracking_type::block_size;
+		delta.size = bincontent_.size();
+		delta.n_entries = n_entries_;
+		dirty().for_each([&](size_t block) {
+			size_t first = block*delta.block_size;
+			size_t last = std::min(first + delta.block_size, delta.size);
+			delta.blocks.push_back(block);
+			delta.bincontent.insert(delta.bincontent.end(), bincontent_.begin()+first, bincontent_.begin()+last);
+			delta.squaredweights.insert(delta.squaredweights.end(), squaredweights_.begin()+first, squaredweights_.begin()+last);
+		});
+		dirty().clear();
+		return delta;
+	}
+	
+	/**
+	 * @brief Overwrite the blocks in delta, e.g. to keep a replica in sync
+	 *
+	 * @throws std::invalid_argument if delta came from a histogram with a
+	 *         different number of bins, or is malformed. The histogram is
+	 *         left untouched in that case.
+	 */
+	void apply_delta(const bin_delta &delta)
+	{
+		if (delta.size != bincontent_.size())
+			throw std::invalid_argument("Delta does not match the size of the histogram");
+		if (delta.block_size == 0)
+			throw std::invalid_argument("Delta has zero block size");
+		// Check every block before writing any
+		const size_t n_blocks = (delta.size + delta.block_size - 1)/delta.block_size;
+		size_t expected = 0;
+		for (size_t block : delta.blocks) {
+			if (block >= n_blocks)
+				throw std::invalid_argument("Delta block out of range");
+			expected += std::min(delta.block_size, delta.size - block*delta.block_size);
+		}
+		if (delta.bincontent.size() < expected || delta.squaredweights.size() < expected)
+			throw std::invalid_argument("Truncated delta");
+		
+		write_section section(*this);
+		size_t pos = 0;
+		for (size_t block : delta.blocks) {
+			size_t first = block*delta.block_size;
+			size_t count = std::min(delta.block_size, delta.size - first);
+			std::copy(delta.bincontent.begin()+pos, delta.bincontent.begin()+pos+count, bincontent_.begin()+first);
+			std::copy(delta.squaredweights.begin()+pos, delta.squaredweights.begin()+pos+count, squaredweights_.begin()+first);
+			dirty().mark(first);
+			pos += count;
 		}
+		n_entries_ = delta.n_entries;
+	}
+	
+	/**
+	 * @brief Multiply all bin contents by factor (and squared weights by
+	 *        its square), as if every entry had been filled with its
+	 *        weight multiplied by factor
+	 */
+	void scale(double factor)
+	{
+		write_section section(*this);
+		for (double &v : bincontent_)
+			v *= factor;
+		for (double &v : squaredweights_)
+			v *= factor*factor;
+		dirty().mark_all();
+	}
+	
+	/**
+	 * @brief Zero all bins, the entry count and the fill statistics
+	 *
+	 * Large bin arrays from allocators that map anonymous memory
+	 * themselves, such as mmap_allocator, are cleared by returning their
+	 * pages to the kernel; see detail::discardable_pages and
+	 * detail::zero().
+	 */
+	void reset()
+	{
+		write_section section(*this);
+		detail::discardable_pages<allocator_type> discardable;
+		detail::zero(bincontent_.data(), bincontent_.size(), discardable);
+		detail::zero(squaredweights_.data(), squaredweights_.size(), discardable);
+		n_entries_ = 0;
+		statistics_type &stats = *this;
+		stats.clear();
+		dirty().mark_all();
+	}
+	
+	/**
+	 * @brief Copy the bins and entry count consistently
+	 *
+	 * With sync::seqlock in the traits this may be called from any thread
+	 * while one other thread fills; the copy is retried if a fill
+	 * intervened. Without it, fills must not run concurrently.
+	 *
+	 * @throws std::runtime_error if no consistent copy was obtained in
+	 *         max_attempts tries
+	 */
+	snapshot_type snapshot(size_t max_attempts=1000) const
+	{
+		std::vector<double> sumw, sumw2;
+		size_t entries = 0;
+		bool consistent = seq().read([&]() {
+			sumw.assign(bincontent_.begin(), bincontent_.end());
+			sumw2.assign(squaredweights_.begin(), squaredweights_.end());
+			entries = n_entries_;
+		}, max_attempts);
+		if (!consistent)
+			throw std::runtime_error("Couldn't take a consistent snapshot");
+		typedef std::integral_constant<bool, layout_type::is_row_major> row_major;
+		return snapshot_type{ entries, owned_view(std::move(sumw), row_major()),
+		    owned_view(std::move(sumw2), row_major()) };
 	}
+	
+	/** Fill statistics, if enabled with HISTOGRAM_FILL_STATISTICS */
+	const statistics_type& statistics() const { return *this; }
 
-	std::array<size_t, sizeof...(Dimensions)> shape() const
+	/** Number of bins along each axis, including flow bins */
+	const std::array<size_t, sizeof...(Dimensions)>& shape() const { return shape_; }
+	
+	/** @brief Bin edges of each axis, referring to the axes' own storage */
+	std::array<span<const double>, sizeof...(Dimensions)> edges() const
 	{
-		std::array<size_t, sizeof...(Dimensions)> shape;
-		this->fill_shape(shape);
-		return shape;
+		std::array<span<const double>, sizeof...(Dimensions)> edges;
+		this->fill_edges(edges);
+		return edges;
+	}
+	
+	/** @brief Bin edges of one axis, referring to the axis' own storage */
+	span<const double> edges(size_t axis) const
+	{
+		span<const double> edges;
+		with_axis(axis, [&](const auto &dim) { edges = dim.edges(); });
+		return edges;
 	}
 	
+	/** @brief Label of one axis */
+	const std::string& label(size_t axis) const
+	{
+		const std::string *name = nullptr;
+		with_axis(axis, [&](const auto &dim) { name = &dim.name(); });
+		return *name;
+	}
+	
+	/** @brief Copies of the axes, which share their edges with this histogram's */
+	std::tuple<Dimensions...> axes() const
+	{ return histogram_impl<Dimensions...>::axes(); }
+	
+	/** Copies of the bin edges of each axis */
 	std::array<std::vector<double>, sizeof...(Dimensions)> binedges() const
 	{
 		std::array<std::vector<double>, sizeof...(Dimensions)> shape;
@@ -326,30 +1575,277 @@ public:
 		return std::move(shape);
 	}
 	
+	/** @brief Call visitor(i, axis) with the binning scheme of each dimension */
+	template <typename Visitor>
+	void for_each_axis(Visitor &&visitor) const
+	{
+		this->visit_axes(visitor);
+	}
+	
+	/** Bin contents in row-major order */
 	auto bincontent() const
-	{ return detail::view<double, sizeof...(Dimensions)>(bincontent_.data(), shape()); }
+	{ return make_view(bincontent_, std::integral_constant<bool, layout_type::is_row_major>()); }
 	
+	/** Sums of squared weights in row-major order */
 	auto squaredweights() const
-	{ return detail::view<double, sizeof...(Dimensions)>(squaredweights_.data(), shape()); }
+	{ return make_view(squaredweights_, std::integral_constant<bool, layout_type::is_row_major>()); }
+	
+	size_t n_entries() const { return n_entries_; }
 	
-	auto n_entries() const { return n_entries_; }
+	/** The allocator of the bin arrays */
+	allocator_type get_allocator() const { return bincontent_.get_allocator(); }
+	
+	/** Bytes currently held by this histogram */
+	memory_footprint memory_usage() const
+	{
+		memory_footprint usage;
+		usage.bins = (bincontent_.capacity() + squaredweights_.capacity())*sizeof(double)
+		    + scratch_.bytes();
+		usage.strings = title_.capacity();
+		usage.object = sizeof(*this);
+		this->fill_memory(usage);
+		return usage;
+	}
 	
 private:
+	typedef std::vector<double, allocator_type> storage_type;
+	typedef detail::view<double, sizeof...(Dimensions)> view_type;
+	
+	typename tracking_type::bitmap& dirty() { return *this; }
+	const typename sync_type::sequence& seq() const { return *this; }
+	
+	// Brackets a modification for readers of snapshot()
+	class write_section {
+	public:
+		write_section(typename sync_type::sequence &seq) : seq_(seq) { seq_.begin_write(); }
+		~write_section() { seq_.end_write(); }
+	private:
+		typename sync_type::sequence &seq_;
+	};
+	
+	template <typename... Args>
+	bool fill_one(double weight, Args...args)
+	{
+		statistics_type &stats = *this;
+		if (this->valid(args...)) {
+			size_t offset = this->offset(std::integral_constant<bool, layout_type::is_row_major>(),
+			    stats, args...);
+			sync_type::add(bincontent_.at(offset), weight);
+			sync_type::add(squaredweights_.at(offset), weight*weight);
+			dirty().mark(offset);
+			n_entries_++;
+			stats.accept(weight);
+			return true;
+		} else {
+			stats.reject();
+			return false;
+		}
+	}
+	
+	template <typename... Args>
+	size_t offset(std::true_type, statistics_type &stats, Args...args)
+	{
+		return this->visit_index(stats, 0, args...);
+	}
+	
+	template <typename... Args>
+	size_t offset(std::false_type, statistics_type &stats, Args...args)
+	{
+		detail::coordinate_recorder<sizeof...(Dimensions), statistics_type> recorder(stats);
+		this->visit_index(recorder, 0, args...);
+		return mapping_.offset(recorder.coords);
+	}
+	
+	// Number of private copies to use in fill_batch() of n entries, or 0
+	// for none. Beyond a few thousand bins the copies no longer fit in
+	// cache, and clearing and summing them costs of order Lanes*size, so
+	// they only pay off for batches several times larger than that.
+	size_t privatized_lanes(std::true_type, size_t n) const
+	{
+		const size_t size = bincontent_.size();
+		size_t lanes = size <= 512 ? 8 : (size <= 2048 ? 4 : 0);
+		return n >= 4*lanes*size ? lanes : 0;
+	}
+	size_t privatized_lanes(std::false_type, size_t) const { return 0; }
+	
+	template <size_t Lanes, typename... Columns>
+	size_t fill_privatized(size_t n, const double *weights, const Columns*...columns)
+	{
+		statistics_type &stats = *this;
+		const size_t size = bincontent_.size();
+		// Copy j of bin k lives at [k*Lanes + j] for both sums. The copies
+		// are zeroed again as they are summed.
+		double *sumw = scratch_.zeroed(2*size*Lanes), *sumw2 = sumw + size*Lanes;
+		size_t accepted = 0;
+		for (size_t i=0; i < n; i += Lanes) {
+			const size_t end = std::min(n, i+Lanes);
+			for (size_t j=i; j < end; j++) {
+				const double weight = weights ? weights[j] : 1.;
+				if (this->valid(columns[j]...)) {
+					size_t offset = this->offset(std::integral_constant<bool, layout_type::is_row_major>(),
+					    stats, columns[j]...)*Lanes + (j-i);
+					sumw[offset] += weight;
+					sumw2[offset] += weight*weight;
+					stats.accept(weight);
+					accepted++;
+				} else {
+					stats.reject();
+				}
+			}
+		}
+		for (size_t k=0; k < size; k++) {
+			double w = 0, w2 = 0;
+			for (size_t j=0; j < Lanes; j++) {
+				w += sumw[k*Lanes+j];
+				w2 += sumw2[k*Lanes+j];
+				sumw[k*Lanes+j] = sumw2[k*Lanes+j] = 0;
+			}
+			if (w != 0 || w2 != 0) {
+				sync_type::add(bincontent_[k], w);
+				sync_type::add(squaredweights_[k], w2);
+				dirty().mark(k);
+			}
+		}
+		n_entries_ += accepted;
+		return accepted;
+	}
+	
+	template <typename... Columns>
+	size_t fill_vectorized(std::true_type, size_t n, const double *weights, const Columns*...columns)
+	{
+		const size_t block = 256;
+		size_t offsets[block], bins[block];
+		double w[block];
+		size_t accepted = 0;
+		for (size_t i=0; i < n; i += block) {
+			const size_t m = std::min(block, n-i);
+			std::fill(offsets, offsets+m, 0);
+			this->index_batch(m, offsets, bins, (columns+i)...);
+			// Rejected entries are added to bin 0 with zero weight
+			for (size_t j=0; j < m; j++) {
+				bool valid = this->valid(columns[i+j]...);
+				w[j] = valid ? (weights ? weights[i+j] : 1.) : 0.;
+				offsets[j] = valid ? offsets[j] : 0;
+				accepted += valid;
+				if (valid)
+					dirty().mark(offsets[j]);
+			}
+			detail::simd::scatter_add(m, offsets, w, bincontent_.data(), squaredweights_.data());
+		}
+		n_entries_ += accepted;
+		return accepted;
+	}
+	
+	template <typename... Columns>
+	size_t fill_vectorized(std::false_type, size_t, const double *, const Columns*...)
+	{ return 0; }
+	
+	void add(std::true_type, const double *bincontent, const double *squaredweights)
+	{
+		for (size_t i=0; i < bincontent_.size(); i++) {
+			sync_type::add(bincontent_[i], bincontent[i]);
+			sync_type::add(squaredweights_[i], squaredweights[i]);
+			if (bincontent[i] != 0 || squaredweights[i] != 0)
+				dirty().mark(i);
+		}
+	}
+	
+	void add(std::false_type, const double *bincontent, const double *squaredweights)
+	{
+		auto shape = this->shape();
+		std::array<size_t, sizeof...(Dimensions)> coords;
+		coords.fill(0);
+		for (size_t k=0; k < this->size(); k++) {
+			size_t offset = mapping_.offset(coords);
+			sync_type::add(bincontent_[offset], bincontent[k]);
+			sync_type::add(squaredweights_[offset], squaredweights[k]);
+			if (bincontent[k] != 0 || squaredweights[k] != 0)
+				dirty().mark(offset);
+			for (size_t i=sizeof...(Dimensions); i > 0; i--) {
+				if (++coords[i-1] < shape[i-1])
+					break;
+				coords[i-1] = 0;
+			}
+		}
+	}
+	
+	view_type make_view(const storage_type &bins, std::true_type) const
+	{ return view_type(bins.data(), shape()); }
+	
+	view_type owned_view(std::vector<double> &&bins, std::true_type) const
+	{ return view_type(std::move(bins), shape()); }
+	
+	view_type owned_view(std::vector<double> &&bins, std::false_type) const
+	{ return make_view(bins, std::false_type()); }
+	
+	// Gather bins into a row-major buffer owned by the view
+	template <typename Storage>
+	view_type make_view(const Storage &bins, std::false_type) const
+	{
+		auto shape = this->shape();
+		std::vector<double> buffer(this->size());
+		std::array<size_t, sizeof...(Dimensions)> coords;
+		coords.fill(0);
+		for (double &value : buffer) {
+			value = bins[mapping_.offset(coords)];
+			for (size_t i=sizeof...(Dimensions); i > 0; i--) {
+				if (++coords[i-1] < shape[i-1])
+					break;
+				coords[i-1] = 0;
+			}
+		}
+		return view_type(std::move(buffer), shape);
+	}
+	
+	basic_histogram(const histogram_impl<Dimensions...> &axes, const std::string &title)
+	    : histogram_impl<Dimensions...>(axes),
+	      tracking_type::bitmap(typename layout_type::template mapping<sizeof...(Dimensions)>(axes_shape()).size()),
+	      title_(title), shape_(axes_shape()), mapping_(shape_),
+	      bincontent_(mapping_.size()), squaredweights_(mapping_.size()),
+	      n_entries_(detail::entry_counter<allocator_type>::make(bincontent_.get_allocator()))
+	{}
+	
+	std::array<size_t, sizeof...(Dimensions)> axes_shape() const
+	{
+		std::array<size_t, sizeof...(Dimensions)> shape;
+		this->fill_shape(shape);
+		return shape;
+	}
+	
+	// Axes copied from the same axis share their edges, so comparing
+	// addresses settles the common case without looking at the edges
+	bool same_binning(const basic_histogram &other) const
+	{
+		auto mine = edges(), theirs = other.edges();
+		bool shared = true;
+		for (size_t i=0; i < sizeof...(Dimensions); i++)
+			shared = shared && mine[i].data() == theirs[i].data();
+		return shared || mine == theirs;
+	}
+	
+	// Call f(dim) with the binning scheme of one dimension
+	template <typename Function>
+	void with_axis(size_t axis, Function &&f) const
+	{
+		if (axis >= sizeof...(Dimensions))
+			throw std::out_of_range("Axis out of range");
+		auto visitor = [&](size_t i, const auto &dim) { if (i == axis) f(dim); };
+		this->visit_axes(visitor);
+	}
+	
 	std::string title_;
-	size_t n_entries_;
-	std::vector<double> bincontent_, squaredweights_;
+	std::array<size_t, sizeof...(Dimensions)> shape_;
+	typename layout_type::template mapping<sizeof...(Dimensions)> mapping_;
+	storage_type bincontent_, squaredweights_;
+	// After the bins, so that it can be placed by their allocator
+	typename detail::entry_counter<allocator_type>::type n_entries_;
+	detail::scratch_buffer scratch_;
 
 };
 
-template<typename... Conds>
-  struct and_
-  : std::true_type
-  { };
-
-template<typename Cond, typename... Conds>
-  struct and_<Cond, Conds...>
-  : std::conditional<Cond::value, and_<Conds...>, std::false_type>::type
-  { };
+/** @brief A histogram with default storage */
+template <class... Dimensions>
+using histogram = basic_histogram<default_traits, Dimensions...>;
 
 template <class... Ts>
 typename std::enable_if<and_<std::is_base_of<binning::dimension_tag, Ts>... >::value, histogram<Ts...> >::type
@@ -365,6 +1861,72 @@ create(const std::string &title, Ts...ts)
 	return std::move(histogram<Ts...>(ts..., title));
 }
 
+/**
+ * @brief Bytes a histogram with the given axes would hold, without
+ *        allocating its bins
+ */
+template <class... Ts>
+memory_footprint projected_memory_usage(const Ts&...ts)
+{
+	std::array<size_t, sizeof...(Ts)> nbins = {{ ts.nbins()... }};
+	std::array<size_t, sizeof...(Ts)> nedges = {{ ts.edges().size()... }};
+	std::array<size_t, sizeof...(Ts)> nchars = {{ ts.name().size()... }};
+	memory_footprint usage;
+	usage.bins = 2*sizeof(double);
+	for (size_t i=0; i < sizeof...(Ts); i++) {
+		usage.bins *= nbins[i];
+		usage.edges += nedges[i]*sizeof(double);
+		usage.strings += nchars[i];
+	}
+	usage.object = sizeof(histogram<Ts...>);
+	return usage;
+}
+
+namespace detail {
+
+template <class... Ts>
+std::string axis_signature()
+{
+	std::array<std::string, sizeof...(Ts)> names = {{ binning::type_name<Ts>::value()... }};
+	std::string signature;
+	for (const auto &name : names) {
+		if (!signature.empty())
+			signature += ",";
+		signature += name;
+	}
+	return signature;
+}
+
+}
+
+/**
+ * @brief Comma-separated names of the binning schemes of a histogram,
+ *        e.g. "linear,general"
+ */
+template <class Traits, class... Ts>
+std::string axis_signature(const basic_histogram<Traits, Ts...> &)
+{
+	return detail::axis_signature<Ts...>();
+}
+
+/**
+ * @brief FNV-1a hash of the bin edges of all axes of a histogram
+ *
+ * Used to check that histograms in different processes have the same
+ * binning without exchanging their edges.
+ */
+template <typename Histogram>
+uint64_t binning_fingerprint(const Histogram &hist)
+{
+	uint64_t hash = 0xcbf29ce484222325ull;
+	for (span<const double> edges : hist.edges()) {
+		const unsigned char *bytes = reinterpret_cast<const unsigned char*>(edges.data());
+		for (size_t i=0; i < edges.size()*sizeof(double); i++)
+			hash = (hash ^ bytes[i])*0x100000001b3ull;
+	}
+	return hash;
+}
+
 }
 
 #endif
\ No newline at end of file
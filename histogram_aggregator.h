@@ -0,0 +1,495 @@
+
+#ifndef HISTOGRAM_AGGREGATOR_H_INCLUDED
+#define HISTOGRAM_AGGREGATOR_H_INCLUDED
+
+#include "histogram.h"
+#include "histogram_storage.h"
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <stdexcept>
+
+namespace histogram {
+
+namespace detail {
+
+/**
+ * @brief Framing of one histogram delta on an aggregator socket
+ *
+ * The header is followed by the name and then either 2*nbins doubles
+ * (bin contents, then squared weights, in row-major order) or, if
+ * nsparse != dense, nsparse row-major offsets followed by nsparse bin
+ * contents and nsparse squared weights. Both ends are on the same host,
+ * so everything is in native byte order.
+ */
+struct delta_header {
+	static constexpr uint32_t expected_magic = 0x47414844; // "DHAG"
+	static constexpr uint64_t dense = ~uint64_t(0);
+
+	uint32_t magic;
+	uint32_t name_size;
+	uint64_t fingerprint;
+	uint64_t n_entries;
+	uint64_t nbins;
+	uint64_t nsparse;
+
+	size_t payload_size() const
+	{
+		return name_size + (nsparse == dense ? 2*nbins*sizeof(double)
+		    : nsparse*(sizeof(uint64_t) + 2*sizeof(double)));
+	}
+};
+
+template <typename Histogram>
+size_t total_bins(const Histogram &hist)
+{
+	size_t size = 1;
+	for (size_t n : hist.shape())
+		size *= n;
+	return size;
+}
+
+inline void make_unix_address(const std::string &path, sockaddr_un &addr)
+{
+	std::memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (path.size() >= sizeof(addr.sun_path))
+		throw std::invalid_argument("Socket path too long: " + path);
+	std::strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path)-1);
+}
+
+}
+
+/**
+ * @brief Sends the contents of histograms in a worker to an aggregator
+ *
+ * Each send() transmits what was filled since the previous send() and
+ * then resets the local histogram, so the aggregator only ever adds.
+ * Mostly empty histograms are sent as a list of non-zero bins.
+ */
+class aggregator_client {
+public:
+	/**
+	 * @param[in] path filesystem path of the aggregator's socket
+	 * @throws std::runtime_error if the aggregator can't be reached
+	 */
+	explicit aggregator_client(const std::string &path)
+	{
+		sockaddr_un addr;
+		detail::make_unix_address(path, addr);
+		fd_ = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (fd_ < 0)
+			throw std::runtime_error("Couldn't create socket");
+		if (connect(fd_, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0) {
+			close(fd_);
+			throw std::runtime_error("Couldn't connect to aggregator at " + path);
+		}
+	}
+	aggregator_client(const aggregator_client&) = delete;
+	aggregator_client& operator=(const aggregator_client&) = delete;
+	~aggregator_client() { close(fd_); }
+
+	/**
+	 * @brief Send the entries in hist to the aggregator and reset it
+	 *
+	 * @param[in] name name under which the aggregator booked the histogram
+	 * @throws std::runtime_error if the connection is lost; hist is then
+	 *         left untouched
+	 */
+	template <typename Histogram>
+	void send(const std::string &name, Histogram &hist)
+	{
+		auto content = hist.bincontent();
+		auto squares = hist.squaredweights();
+		const size_t nbins = detail::total_bins(hist);
+
+		detail::delta_header header;
+		header.magic = detail::delta_header::expected_magic;
+		header.name_size = name.size();
+		header.fingerprint = binning_fingerprint(hist);
+		header.n_entries = hist.n_entries();
+		header.nbins = nbins;
+
+		offsets_.clear();
+		for (size_t i=0; i < nbins; i++)
+			if (content.data_[i] != 0 || squares.data_[i] != 0)
+				offsets_.push_back(i);
+
+		buffer_.clear();
+		if (offsets_.size()*(sizeof(uint64_t) + 2*sizeof(double)) < 2*nbins*sizeof(double)) {
+			header.nsparse = offsets_.size();
+			append(&header, sizeof(header));
+			append(name.data(), name.size());
+			append(offsets_.data(), offsets_.size()*sizeof(uint64_t));
+			for (uint64_t i : offsets_)
+				append(content.data_+i, sizeof(double));
+			for (uint64_t i : offsets_)
+				append(squares.data_+i, sizeof(double));
+		} else {
+			header.nsparse = detail::delta_header::dense;
+			append(&header, sizeof(header));
+			append(name.data(), name.size());
+			append(content.data_, nbins*sizeof(double));
+			append(squares.data_, nbins*sizeof(double));
+		}
+
+		for (size_t sent = 0; sent < buffer_.size(); ) {
+			ssize_t n = ::send(fd_, buffer_.data()+sent, buffer_.size()-sent, MSG_NOSIGNAL);
+			if (n < 0 && errno == EINTR)
+				continue;
+			if (n <= 0)
+				throw std::runtime_error("Lost connection to aggregator");
+			sent += n;
+		}
+		hist.reset();
+	}
+
+private:
+	void append(const void *data, size_t size)
+	{
+		const char *bytes = static_cast<const char*>(data);
+		buffer_.insert(buffer_.end(), bytes, bytes+size);
+	}
+
+	int fd_;
+	std::vector<uint64_t> offsets_;
+	std::vector<char> buffer_;
+};
+
+/**
+ * @brief Merges histogram deltas sent by workers over a Unix socket
+ *
+ * Histograms must be booked under a name before workers send to it;
+ * deltas for unknown names or with different binning are dropped and
+ * counted. If a snapshot file is configured with save_every(), all
+ * histograms are written to it periodically and once more on
+ * destruction. Each snapshot replaces the previous file atomically.
+ *
+ * The aggregator is single-threaded: call poll() from an event loop,
+ * or run() to serve until stop() is called (e.g. from a signal handler).
+ */
+class aggregator {
+public:
+	/**
+	 * @param[in] path filesystem path at which to listen. An existing
+	 *                 socket at that path is replaced.
+	 */
+	explicit aggregator(const std::string &path)
+	    : path_(path), stop_(false), n_merged_(0), n_dropped_(0), max_bins_(0)
+	{
+		sockaddr_un addr;
+		detail::make_unix_address(path, addr);
+		listener_ = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (listener_ < 0)
+			throw std::runtime_error("Couldn't create socket");
+		unlink(path.c_str());
+		if (bind(listener_, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0
+		    || listen(listener_, SOMAXCONN) != 0) {
+			close(listener_);
+			throw std::runtime_error("Couldn't listen at " + path);
+		}
+		fcntl(listener_, F_SETFL, O_NONBLOCK);
+	}
+	aggregator(const aggregator&) = delete;
+	aggregator& operator=(const aggregator&) = delete;
+	~aggregator()
+	{
+		for (const auto &conn : connections_)
+			close(conn.first);
+		close(listener_);
+		unlink(path_.c_str());
+		if (!snapshot_.empty()) {
+			try {
+				snapshot();
+			} catch (...) {}
+		}
+	}
+
+	/**
+	 * @brief Create the master histogram that deltas sent under name are
+	 *        added to
+	 *
+	 * @throws std::invalid_argument if a histogram of that name exists
+	 */
+	template <class... Ts>
+	typename std::enable_if<and_<std::is_base_of<binning::dimension_tag, Ts>... >::value, histogram<Ts...>& >::type
+	book(const std::string &name, Ts...ts)
+	{
+		if (entries_.count(name))
+			throw std::invalid_argument("Histogram " + name + " is already booked");
+		std::unique_ptr<entry<histogram<Ts...> > > item(new entry<histogram<Ts...> >(ts..., name));
+		histogram<Ts...> &hist = item->hist;
+		max_bins_ = std::max(max_bins_, detail::total_bins(hist));
+		entries_.emplace(name, std::move(item));
+		return hist;
+	}
+
+	/** @brief Destroy the named master; deltas sent under its name are dropped */
+	void release(const std::string &name)
+	{
+		if (entries_.erase(name) == 0)
+			return;
+		max_bins_ = 0;
+		for (const auto &item : entries_)
+			max_bins_ = std::max(max_bins_, item.second->nbins());
+	}
+
+	/** @brief Look up a master histogram by name, returning NULL if not found */
+	template <typename Histogram>
+	Histogram* find(const std::string &name)
+	{
+		auto it = entries_.find(name);
+		if (it == entries_.end())
+			return NULL;
+		auto *item = dynamic_cast<entry<Histogram>*>(it->second.get());
+		return item ? &item->hist : NULL;
+	}
+
+	/** @brief Write all histograms to fname at the given interval */
+	void save_every(std::chrono::milliseconds interval, const std::string &fname,
+	    const std::string &where="/")
+	{
+		interval_ = interval;
+		snapshot_ = fname;
+		where_ = where;
+		next_save_ = std::chrono::steady_clock::now() + interval;
+	}
+
+	/** @brief Save all histograms as groups under the given path */
+	void save(hdf5::File file, const std::string &where="/")
+	{
+		for (const auto &item : entries_)
+			item.second->save(file, where, item.first);
+	}
+
+	void save(const std::string &fname, const std::string &where="/")
+	{
+		save(hdf5::open_file(fname, hdf5::File::append), where);
+	}
+
+	/**
+	 * @brief Accept connections and merge received deltas, waiting at
+	 *        most timeout_ms for something to happen
+	 *
+	 * @returns the number of deltas merged
+	 */
+	size_t poll(int timeout_ms)
+	{
+		std::vector<pollfd> fds(1);
+		fds[0].fd = listener_;
+		fds[0].events = POLLIN;
+		for (const auto &conn : connections_) {
+			pollfd p;
+			p.fd = conn.first;
+			p.events = POLLIN;
+			fds.push_back(p);
+		}
+		if (!snapshot_.empty()) {
+			auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(
+			    next_save_ - std::chrono::steady_clock::now()).count();
+			timeout_ms = std::max(0, int(std::min<long long>(timeout_ms, remaining)));
+		}
+
+		size_t merged = n_merged_;
+		if (::poll(fds.data(), fds.size(), timeout_ms) > 0) {
+			for (size_t i=1; i < fds.size(); i++)
+				if (fds[i].revents)
+					receive(fds[i].fd);
+			if (fds[0].revents & POLLIN)
+				accept_all();
+		}
+		if (!snapshot_.empty() && std::chrono::steady_clock::now() >= next_save_) {
+			snapshot();
+			next_save_ += interval_;
+		}
+		return n_merged_ - merged;
+	}
+
+	/** @brief Serve until stop() is called */
+	void run()
+	{
+		while (!stop_.load())
+			poll(100);
+		stop_.store(false);
+	}
+
+	/** @brief Make run() return. Safe to call from a signal handler or another thread. */
+	void stop() { stop_.store(true); }
+
+	/** Number of deltas added to master histograms */
+	size_t n_merged() const { return n_merged_; }
+	/**
+	 * Number of deltas dropped because of an unknown name or different
+	 * binning, or because their header was malformed, in which case the
+	 * connection is closed as well
+	 */
+	size_t n_dropped() const { return n_dropped_; }
+	/** Number of connected workers */
+	size_t n_connections() const { return connections_.size(); }
+
+private:
+	struct entry_base {
+		virtual ~entry_base() {}
+		virtual size_t nbins() const = 0;
+		virtual bool merge(const detail::delta_header &header, const char *payload) = 0;
+		virtual void save(hdf5::File file, const std::string &where, const std::string &name) const = 0;
+	};
+
+	template <typename Histogram>
+	struct entry : public entry_base {
+		template <typename... Args>
+		entry(Args...args) : hist(args...), fingerprint(binning_fingerprint(hist)) {}
+		size_t nbins() const { return detail::total_bins(hist); }
+		bool merge(const detail::delta_header &header, const char *payload)
+		{
+			if (header.fingerprint != fingerprint || header.nbins != detail::total_bins(hist))
+				return false;
+			// Copy out of the receive buffer, which need not be aligned
+			if (header.nsparse == detail::delta_header::dense) {
+				sumw.resize(header.nbins);
+				sumw2.resize(header.nbins);
+				std::memcpy(sumw.data(), payload, header.nbins*sizeof(double));
+				std::memcpy(sumw2.data(), payload + header.nbins*sizeof(double), header.nbins*sizeof(double));
+			} else {
+				sumw.assign(header.nbins, 0.);
+				sumw2.assign(header.nbins, 0.);
+				const char *values = payload + header.nsparse*sizeof(uint64_t);
+				const char *squares = values + header.nsparse*sizeof(double);
+				for (size_t i=0; i < header.nsparse; i++) {
+					uint64_t offset;
+					std::memcpy(&offset, payload + i*sizeof(uint64_t), sizeof(offset));
+					if (offset >= header.nbins)
+						return false;
+					std::memcpy(&sumw[offset], values + i*sizeof(double), sizeof(double));
+					std::memcpy(&sumw2[offset], squares + i*sizeof(double), sizeof(double));
+				}
+			}
+			hist.add(header.n_entries, sumw.data(), sumw2.data());
+			return true;
+		}
+		void save(hdf5::File file, const std::string &where, const std::string &name) const
+		{ ::histogram::save(hist, file, where, name, true); }
+		Histogram hist;
+		uint64_t fingerprint;
+		std::vector<double> sumw, sumw2;
+	};
+
+	void accept_all()
+	{
+		int fd;
+		while ((fd = accept(listener_, NULL, NULL)) >= 0) {
+			fcntl(fd, F_SETFL, O_NONBLOCK);
+			connections_[fd];
+		}
+	}
+
+	// Longest histogram name accepted from a worker
+	static constexpr size_t max_name_size = 4096;
+	// Most bytes read from one worker per call to poll(), so that a busy
+	// worker can neither starve the others nor grow its buffer unchecked.
+	// poll() is level-triggered, so the rest is picked up on the next call.
+	static constexpr size_t read_limit = size_t(1) << 20;
+
+	// Whether a header could belong to a booked histogram. This bounds
+	// what is buffered for a delta by the largest booked histogram.
+	bool plausible(const detail::delta_header &header) const
+	{
+		return header.magic == detail::delta_header::expected_magic
+		    && header.name_size <= max_name_size && header.nbins <= max_bins_
+		    && (header.nsparse == detail::delta_header::dense || header.nsparse <= header.nbins);
+	}
+
+	// Read what is available from a worker, up to read_limit, and merge
+	// all complete deltas
+	void receive(int fd)
+	{
+		std::vector<char> &buffer = connections_[fd];
+		bool closed = false;
+		char chunk[65536];
+		for (size_t total = 0; total < read_limit; ) {
+			ssize_t n = read(fd, chunk, sizeof(chunk));
+			if (n > 0) {
+				buffer.insert(buffer.end(), chunk, chunk+n);
+				total += n;
+			} else if (n < 0 && errno == EINTR) {
+				continue;
+			} else {
+				closed = (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK));
+				break;
+			}
+		}
+
+		size_t pos = 0;
+		while (buffer.size() - pos >= sizeof(detail::delta_header)) {
+			detail::delta_header header;
+			std::memcpy(&header, buffer.data()+pos, sizeof(header));
+			if (!plausible(header)) {
+				n_dropped_++;
+				closed = true;
+				break;
+			}
+			if (buffer.size() - pos - sizeof(header) < header.name_size)
+				break;
+			const char *name = buffer.data() + pos + sizeof(header);
+			auto it = entries_.find(std::string(name, header.name_size));
+			if (it != entries_.end() && header.nbins > it->second->nbins()) {
+				n_dropped_++;
+				closed = true;
+				break;
+			}
+			if (buffer.size() - pos - sizeof(header) < header.payload_size())
+				break;
+			if (it != entries_.end() && it->second->merge(header, name + header.name_size))
+				n_merged_++;
+			else
+				n_dropped_++;
+			pos += sizeof(header) + header.payload_size();
+		}
+		buffer.erase(buffer.begin(), buffer.begin()+pos);
+
+		if (closed) {
+			close(fd);
+			connections_.erase(fd);
+		}
+	}
+
+	// Write to a temporary file and move it into place, so that readers
+	// never see a partial snapshot
+	void snapshot()
+	{
+		std::string tmp = snapshot_ + ".tmp";
+		{
+			hdf5::File file = hdf5::open_file(tmp, hdf5::File::write);
+			save(file, where_);
+		}
+		std::rename(tmp.c_str(), snapshot_.c_str());
+	}
+
+	std::string path_;
+	int listener_;
+	std::atomic<bool> stop_;
+	size_t n_merged_, n_dropped_;
+	// Number of bins of the largest booked histogram
+	size_t max_bins_;
+	std::map<int, std::vector<char> > connections_;
+	std::map<std::string, std::unique_ptr<entry_base> > entries_;
+	std::string snapshot_, where_;
+	std::chrono::milliseconds interval_;
+	std::chrono::steady_clock::time_point next_save_;
+};
+
+}
+
+#endif // HISTOGRAM_AGGREGATOR_H_INCLUDED
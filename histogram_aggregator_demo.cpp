@@ -0,0 +1,48 @@
+
+#include "histogram.h"
+#include "histogram_aggregator.h"
+
+#include <sys/wait.h>
+#include <random>
+
+// Fork a few workers that each fill a histogram and ship their entries to
+// an aggregator every 10000 fills, while the parent merges them and
+// writes a snapshot to aggregated.hdf5 every second.
+int main ()
+{
+	const char *socket_path = "/tmp/histogram_aggregator_demo.sock";
+	const int nworkers = 4;
+	const int nfills = 100000;
+	
+	auto energy = histogram::binning::log10(1, 1e6, 60, "energy");
+	auto zenith = histogram::binning::cosine(0, M_PI, 20, "zenith");
+	
+	histogram::aggregator daemon(socket_path);
+	auto &master = daemon.book("flux", energy, zenith);
+	daemon.save_every(std::chrono::seconds(1), "aggregated.hdf5");
+	
+	for (int w=0; w < nworkers; w++) {
+		if (fork() != 0)
+			continue;
+		histogram::aggregator_client client(socket_path);
+		auto local = histogram::create(energy, zenith);
+		std::mt19937 rng(w);
+		std::uniform_real_distribution<double> logE(0, 6), cosZ(-1, 1);
+		for (int i=1; i <= nfills; i++) {
+			local.fill(std::pow(10, logE(rng)), std::acos(cosZ(rng)));
+			if (i % 10000 == 0)
+				client.send("flux", local);
+		}
+		_exit(0);
+	}
+	
+	while (daemon.n_merged() < size_t(nworkers*nfills/10000))
+		daemon.poll(100);
+	for (int w=0; w < nworkers; w++)
+		wait(NULL);
+	
+	std::cout << "merged " << daemon.n_merged() << " deltas with "
+	    << master.n_entries() << " entries" << std::endl;
+	
+	return 0;
+}
@@ -0,0 +1,263 @@
+
+#ifndef HISTOGRAM_AUTORANGE_H_INCLUDED
+#define HISTOGRAM_AUTORANGE_H_INCLUDED
+
+#include "histogram.h"
+#include "histogram_sketch.h"
+
+#include <cmath>
+#include <limits>
+#include <memory>
+#include <stdexcept>
+#include <tuple>
+#include <utility>
+
+namespace histogram {
+
+/**
+ * @brief Rules that choose an axis from a sample of coordinates
+ *
+ * Each rule has an axis_type and is called with the buffered coordinates
+ * of its dimension and their weights.
+ */
+namespace autorange {
+
+/**
+ * @brief Equispaced bins between the smallest and largest sampled value
+ *
+ * Values outside the domain of the transformation (e.g. non-positive
+ * values on a logarithmic axis) are ignored. The upper limit is placed
+ * just above the largest value, so that every sampled value lands in a
+ * regular bin.
+ */
+template <typename Transformation = binning::detail::identity>
+class uniform {
+public:
+	typedef binning::uniform<Transformation> axis_type;
+
+	uniform(size_t nbins, const std::string &name=std::string())
+	    : nbins_(nbins), name_(name)
+	{
+		if (nbins == 0)
+			throw std::invalid_argument("Need at least one bin");
+	}
+
+	axis_type operator()(size_t n, const double *values, const double *) const
+	{
+		double lo = std::numeric_limits<double>::infinity(), hi = -lo;
+		for (size_t i=0; i < n; i++) {
+			if (!std::isfinite(Transformation::imap(values[i])))
+				continue;
+			lo = std::min(lo, values[i]);
+			hi = std::max(hi, values[i]);
+		}
+		if (!(lo <= hi)) {
+			// Nothing sampled; fall back to the unit interval in the
+			// transformed coordinate
+			lo = Transformation::map(0);
+			hi = Transformation::map(1);
+		} else if (!(Transformation::imap(lo) != Transformation::imap(hi))) {
+			lo = Transformation::map(Transformation::imap(lo)-0.5);
+			hi = Transformation::map(Transformation::imap(hi)+0.5);
+		}
+		if (lo > hi)
+			std::swap(lo, hi);
+		// Nudge the upper limit until the largest value is inside
+		double upper = hi;
+		do {
+			upper = std::nextafter(upper, std::numeric_limits<double>::infinity());
+		} while (!axis_type::below_overflow(lo, upper, nbins_, hi));
+		return axis_type(lo, upper, nbins_, name_);
+	}
+
+private:
+	size_t nbins_;
+	std::string name_;
+};
+
+typedef uniform<> linear;
+typedef uniform<binning::detail::log10> log10;
+
+/**
+ * @brief Bins of equal population, estimated with a quantile_sketch
+ */
+class general {
+public:
+	typedef binning::general axis_type;
+
+	general(size_t nbins, const std::string &name=std::string(), double compression=200)
+	    : nbins_(nbins), name_(name), compression_(compression)
+	{
+		if (nbins == 0)
+			throw std::invalid_argument("Need at least one bin");
+	}
+
+	axis_type operator()(size_t n, const double *values, const double *weights) const
+	{
+		quantile_sketch sketch(compression_);
+		sketch.fill_batch(n, weights, values);
+		if (sketch.total_weight() == 0) {
+			std::vector<double> edges{0., 1.};
+			return axis_type(edges, name_);
+		}
+		return sketch.binning(nbins_, name_);
+	}
+
+private:
+	size_t nbins_;
+	std::string name_;
+	double compression_;
+};
+
+}
+
+/**
+ * @brief A histogram that chooses its binning from the first fills
+ *
+ * The first buffer_size entries are kept as raw coordinates and weights
+ * in one array per dimension. When the buffer is full (or book() is
+ * called) each autorange rule chooses its axis from the buffered
+ * coordinates, the bins are allocated, and the buffer is replayed through
+ * fill_batch(). Fills after that go straight to the histogram, so the
+ * only cost after warm-up is one predictable branch per call.
+ *
+ * Entries with a NaN coordinate are rejected whether or not the binning
+ * has been chosen; others that turn out to lie outside the chosen axes
+ * land in the flow bins as usual. The contents can only be read once
+ * the histogram is booked, by filling enough entries or calling book().
+ *
+ * @tparam Rules autorange rules, one per dimension
+ */
+template <class... Rules>
+class autorange_histogram {
+public:
+	typedef histogram<typename Rules::axis_type...> histogram_type;
+
+	autorange_histogram(size_t buffer_size, Rules...rules, const std::string &title=std::string())
+	    : rules_(rules...), title_(title), buffer_size_(buffer_size)
+	{
+		weights_.reserve(buffer_size_);
+		for (std::vector<double> &column : columns_)
+			column.reserve(buffer_size_);
+	}
+
+	size_t ndim() const { return sizeof...(Rules); }
+	const std::string& title() const { return title_; }
+
+	/** @brief Whether the binning has been chosen */
+	bool booked() const { return bool(hist_); }
+
+	/** @brief Number of entries waiting for the binning to be chosen */
+	size_t buffered() const { return weights_.size(); }
+
+	template <typename... Args>
+	bool fill(Args...args) {
+		return fill_with_weight(1., args...);
+	}
+
+	template <typename... Args>
+	bool fill_with_weight(double weight, Args...args) {
+		static_assert(sizeof...(Args) == sizeof...(Rules), "Number of arguments must match number of dimensions");
+		if (hist_)
+			return hist_->fill_with_weight(weight, args...);
+		bool nan = false;
+		int expand[] = {0, (nan = nan || std::isnan(double(args)), 0)...};
+		(void)expand;
+		if (nan)
+			return false;
+		push(weight, std::index_sequence_for<Rules...>(), args...);
+		if (weights_.size() >= buffer_size_)
+			book();
+		return true;
+	}
+
+	/**
+	 * @brief Fill entries from arrays of coordinates
+	 *
+	 * Entries that fit in the buffer are copied there; the rest go
+	 * through histogram::fill_batch() once the binning is chosen.
+	 */
+	template <typename... Columns>
+	size_t fill_batch(size_t n, const double *weights, const Columns*...columns)
+	{
+		static_assert(sizeof...(Columns) == sizeof...(Rules), "Number of columns must match number of dimensions");
+		size_t i = 0, accepted = 0;
+		for (; i < n && !hist_; i++)
+			accepted += fill_with_weight(weights ? weights[i] : 1., columns[i]...);
+		if (i == n)
+			return accepted;
+		return accepted + hist_->fill_batch(n-i, weights ? weights+i : NULL, (columns+i)...);
+	}
+
+	/**
+	 * @brief Choose the binning from the buffered entries and replay them
+	 *
+	 * Does nothing if the binning has already been chosen.
+	 */
+	histogram_type& book()
+	{
+		if (!hist_)
+			book(std::index_sequence_for<Rules...>());
+		return *hist_;
+	}
+
+	/**
+	 * @brief The booked histogram
+	 *
+	 * @throws std::logic_error if the binning has not been chosen yet
+	 */
+	const histogram_type& get() const
+	{
+		if (!hist_)
+			throw std::logic_error("Histogram " + title_ + " has not been booked yet");
+		return *hist_;
+	}
+
+	// Accessors of the booked histogram, so that it can be passed to
+	// save(). They throw std::logic_error until it is booked.
+	const std::array<size_t, sizeof...(Rules)>& shape() const { return get().shape(); }
+	std::array<std::vector<double>, sizeof...(Rules)> binedges() const { return get().binedges(); }
+	std::array<std::string, sizeof...(Rules)> labels() const { return get().labels(); }
+	size_t n_entries() const { return get().n_entries(); }
+	auto bincontent() const { return get().bincontent(); }
+	auto squaredweights() const { return get().squaredweights(); }
+
+private:
+	template <size_t... I, typename... Args>
+	void push(double weight, std::index_sequence<I...>, Args...args)
+	{
+		weights_.push_back(weight);
+		int expand[] = {0, (columns_[I].push_back(double(args)), 0)...};
+		(void)expand;
+	}
+
+	template <size_t... I>
+	void book(std::index_sequence<I...>)
+	{
+		const size_t n = weights_.size();
+		hist_.reset(new histogram_type(
+		    std::get<I>(rules_)(n, columns_[I].data(), weights_.data())..., title_));
+		hist_->fill_batch(n, weights_.data(), columns_[I].data()...);
+		// Release the buffer
+		std::vector<double>().swap(weights_);
+		for (std::vector<double> &column : columns_)
+			std::vector<double>().swap(column);
+	}
+
+	std::tuple<Rules...> rules_;
+	std::string title_;
+	size_t buffer_size_;
+	std::array<std::vector<double>, sizeof...(Rules)> columns_;
+	std::vector<double> weights_;
+	std::unique_ptr<histogram_type> hist_;
+};
+
+template <class... Rules>
+std::string axis_signature(const autorange_histogram<Rules...> &)
+{
+	return detail::axis_signature<typename Rules::axis_type...>();
+}
+
+}
+
+#endif // HISTOGRAM_AUTORANGE_H_INCLUDED
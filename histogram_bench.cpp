@@ -0,0 +1,261 @@
+
+#include "histogram.h"
+#include "histogram_storage.h"
+#include "histogram_wire.h"
+
+#include <chrono>
+#include <random>
+#include <cstdio>
+
+namespace {
+
+typedef std::chrono::steady_clock clock_type;
+
+double seconds_since(clock_type::time_point start)
+{
+	return std::chrono::duration<double>(clock_type::now()-start).count();
+}
+
+// Book histograms of the given rank with roughly nbins bins per dimension
+histogram::histogram<histogram::binning::linear>
+book(std::integral_constant<int,1>, size_t nbins)
+{
+	using namespace histogram::binning;
+	return histogram::create("bench", linear(-5, 5, nbins, "x"));
+}
+
+histogram::histogram<histogram::binning::linear, histogram::binning::linear>
+book(std::integral_constant<int,2>, size_t nbins)
+{
+	using namespace histogram::binning;
+	return histogram::create("bench", linear(-5, 5, nbins, "x"), linear(-5, 5, nbins, "y"));
+}
+
+histogram::histogram<histogram::binning::linear, histogram::binning::linear, histogram::binning::linear>
+book(std::integral_constant<int,3>, size_t nbins)
+{
+	using namespace histogram::binning;
+	return histogram::create("bench", linear(-5, 5, nbins, "x"), linear(-5, 5, nbins, "y"),
+	    linear(-5, 5, nbins, "z"));
+}
+
+template <typename Histogram>
+void populate(Histogram &h, size_t nentries, std::mt19937 &rng, std::integral_constant<int,1>)
+{
+	std::normal_distribution<double> gauss;
+	for (size_t i=0; i < nentries; i++)
+		h.fill(gauss(rng));
+}
+
+template <typename Histogram>
+void populate(Histogram &h, size_t nentries, std::mt19937 &rng, std::integral_constant<int,2>)
+{
+	std::normal_distribution<double> gauss;
+	for (size_t i=0; i < nentries; i++)
+		h.fill(gauss(rng), gauss(rng));
+}
+
+template <typename Histogram>
+void populate(Histogram &h, size_t nentries, std::mt19937 &rng, std::integral_constant<int,3>)
+{
+	std::normal_distribution<double> gauss;
+	for (size_t i=0; i < nentries; i++)
+		h.fill(gauss(rng), gauss(rng), gauss(rng));
+}
+
+template <typename Histogram>
+size_t total_size(const Histogram &h)
+{
+	size_t size = 1;
+	for (size_t d : h.shape())
+		size *= d;
+	return size;
+}
+
+struct result {
+	double save_time, read_time;
+	hsize_t raw_bytes, stored_bytes, file_size;
+};
+
+template <typename Histogram>
+result measure(const Histogram &h, const std::string &fname, const hdf5::FilterOptions &filters)
+{
+	result r;
+	{
+		hdf5::File file = hdf5::open_file(fname, hdf5::File::write);
+		auto start = clock_type::now();
+		histogram::save(h, file, "/", "h", true, filters);
+		file.flush();
+		r.save_time = seconds_since(start);
+		r.file_size = file.size();
+	}
+	{
+		hdf5::File file = hdf5::open_file(fname, hdf5::File::read);
+		std::vector<double> sumw, sumw2;
+		auto start = clock_type::now();
+		hdf5::Dataset bincontent = file.open_dataset("/h", "_h_bincontent");
+		hdf5::Dataset squaredweights = file.open_dataset("/h", "_h_squaredweights");
+		bincontent.read(sumw);
+		squaredweights.read(sumw2);
+		r.read_time = seconds_since(start);
+		r.raw_bytes = (sumw.size() + sumw2.size())*sizeof(double);
+		r.stored_bytes = bincontent.storage_size() + squaredweights.storage_size();
+	}
+	return r;
+}
+
+template <int Rank>
+void sweep(const std::string &fname, size_t nbins, size_t nentries)
+{
+	std::mt19937 rng(42);
+	auto h = book(std::integral_constant<int,Rank>(), nbins);
+	populate(h, nentries, rng, std::integral_constant<int,Rank>());
+
+	const hsize_t chunk_limits[] = { size_t(2)<<12, size_t(2)<<15, size_t(2)<<19 };
+	const unsigned int levels[] = { 0, 1, 6, 9 };
+	for (hsize_t chunk : chunk_limits) {
+		for (unsigned int level : levels) {
+			for (bool shuffle : { false, true }) {
+				result r = measure(h, fname, hdf5::FilterOptions(chunk, level, shuffle));
+				std::printf("%4d %10zu %8llu %5u %7d %10.1f %10.1f %8.2f %12llu\n",
+				    Rank, total_size(h), (unsigned long long)chunk, level, int(shuffle),
+				    r.raw_bytes/r.save_time/1e6, r.raw_bytes/r.read_time/1e6,
+				    double(r.raw_bytes)/r.stored_bytes, (unsigned long long)r.file_size);
+			}
+		}
+	}
+}
+
+// With in_memory the file is built with the core driver and written out
+// in one piece by the final flush
+void many_small(const std::string &fname, size_t nhists, size_t nbins, const hdf5::FilterOptions &filters,
+    bool in_memory)
+{
+	std::mt19937 rng(42);
+	auto h = book(std::integral_constant<int,1>(), nbins);
+	populate(h, 100*nbins, rng, std::integral_constant<int,1>());
+
+	hdf5::File file = in_memory ? hdf5::open_memory_file(fname, hdf5::File::write)
+	    : hdf5::open_file(fname, hdf5::File::write);
+	auto start = clock_type::now();
+	for (size_t i=0; i < nhists; i++) {
+		std::ostringstream ss;
+		ss << "h" << i;
+		histogram::save(h, file, "/", ss.str(), true, filters);
+	}
+	file.flush();
+	double elapsed = seconds_since(start);
+	hsize_t raw_bytes = nhists*2*total_size(h)*sizeof(double);
+	std::printf("%8zu %6zu %5u %7d %6s %12.1f %10.1f %12llu %10.1f\n",
+	    nhists, total_size(h), filters.complevel, int(filters.shuffle), in_memory ? "core" : "sec2",
+	    1e6*elapsed/nhists, raw_bytes/elapsed/1e6, (unsigned long long)file.size(),
+	    double(file.size())/nhists);
+}
+
+// Time to get at the bins of a histogram on disk: HDF5 reads (and
+// decompresses) the arrays, while the wire format is mapped in place or
+// copied into a new histogram.
+template <int Rank>
+void load_times(const std::string &fname, size_t nbins, size_t nentries)
+{
+	std::mt19937 rng(42);
+	auto h = book(std::integral_constant<int,Rank>(), nbins);
+	populate(h, nentries, rng, std::integral_constant<int,Rank>());
+	std::string wname = fname + ".wire";
+	
+	histogram::save(h, hdf5::open_file(fname, hdf5::File::write), "/", "h", true);
+	histogram::wire::write(h, wname, 4096);
+	
+	auto start = clock_type::now();
+	{
+		hdf5::File file = hdf5::open_file(fname, hdf5::File::read);
+		std::vector<double> sumw, sumw2;
+		file.open_dataset("/h", "_h_bincontent").read(sumw);
+		file.open_dataset("/h", "_h_squaredweights").read(sumw2);
+	}
+	double hdf5_time = seconds_since(start);
+	
+	start = clock_type::now();
+	{
+		histogram::wire::mapped_file file(wname);
+		histogram::wire::reader reader = file.reader();
+		if (reader.size() != total_size(h))
+			std::abort();
+	}
+	double map_time = seconds_since(start);
+	
+	start = clock_type::now();
+	{
+		histogram::wire::mapped_file file(wname);
+		auto copy = histogram::wire::deserialize<decltype(h)>(file.reader());
+	}
+	double load_time = seconds_since(start);
+	
+	std::printf("%4d %10zu %12.1f %12.1f %12.1f\n", Rank, total_size(h),
+	    1e6*hdf5_time, 1e6*map_time, 1e6*load_time);
+	std::remove(wname.c_str());
+}
+
+// Cost per entry of fill_batch() into a small 1-D histogram, for batches
+// too small to amortize the private copies of the bins and large enough
+// to use them
+void fill_times(size_t nbins, size_t batch)
+{
+	std::mt19937 rng(42);
+	std::normal_distribution<double> gauss;
+	std::vector<double> values(batch);
+	for (double &v : values)
+		v = gauss(rng);
+	auto h = book(std::integral_constant<int,1>(), nbins);
+	const size_t nentries = 10000000;
+	const size_t nbatches = std::max(size_t(1), nentries/batch);
+	auto start = clock_type::now();
+	for (size_t i=0; i < nbatches; i++)
+		h.fill_batch(batch, NULL, values.data());
+	double elapsed = seconds_since(start);
+	std::printf("%6zu %8zu %10.2f\n", total_size(h), batch, 1e9*elapsed/(nbatches*batch));
+}
+
+}
+
+int main (int argc, char const *argv[])
+{
+	std::string fname = argc > 1 ? argv[1] : "histogram_bench.hdf5";
+
+	std::printf("# save/read throughput in MB/s of uncompressed bin data\n");
+	std::printf("%4s %10s %8s %5s %7s %10s %10s %8s %12s\n",
+	    "rank", "size", "chunk", "level", "shuffle", "save", "read", "ratio", "file size");
+	sweep<1>(fname, 1000, 100000);
+	sweep<1>(fname, 1000000, 1000000);
+	sweep<2>(fname, 100, 100000);
+	sweep<2>(fname, 1000, 1000000);
+	sweep<3>(fname, 20, 100000);
+	sweep<3>(fname, 100, 1000000);
+
+	std::printf("\n# many small histograms in one file\n");
+	std::printf("%8s %6s %5s %7s %6s %12s %10s %12s %10s\n",
+	    "nhists", "size", "level", "shuffle", "driver", "us/hist", "MB/s", "file size", "bytes/hist");
+	for (size_t nhists : { 100, 1000, 5000 }) {
+		for (bool in_memory : { false, true }) {
+			many_small(fname, nhists, 100, hdf5::FilterOptions(), in_memory);
+			many_small(fname, nhists, 100, hdf5::FilterOptions(size_t(2)<<15, 0, false), in_memory);
+		}
+	}
+
+	std::printf("\n# time in us to load bins: HDF5, mapped wire format, verified wire copy\n");
+	std::printf("%4s %10s %12s %12s %12s\n", "rank", "size", "hdf5", "wire map", "wire load");
+	load_times<1>(fname, 1000, 100000);
+	load_times<1>(fname, 1000000, 1000000);
+	load_times<2>(fname, 1000, 1000000);
+	load_times<3>(fname, 100, 1000000);
+
+	std::remove(fname.c_str());
+
+	std::printf("\n# fill_batch() time in ns/entry\n");
+	std::printf("%6s %8s %10s\n", "size", "batch", "ns/entry");
+	for (size_t nbins : { 100, 1000 })
+		for (size_t batch : { 16, 256, 4096, 65536 })
+			fill_times(nbins, batch);
+
+	return 0;
+}
@@ -0,0 +1,253 @@
+
+#ifndef HISTOGRAM_BINS_H_INCLUDED
+#define HISTOGRAM_BINS_H_INCLUDED
+
+#include "histogram.h"
+
+#include <algorithm>
+#include <cmath>
+#include <iterator>
+#include <memory>
+#include <thread>
+#include <tuple>
+#include <type_traits>
+#include <vector>
+
+namespace histogram {
+
+enum flow_policy {
+	/** Visit every bin, including underflow and overflow */
+	include_flow,
+	/** Visit only bins with finite edges on every axis */
+	skip_flow
+};
+
+namespace detail {
+
+/** @brief What a bin_range and its iterators share */
+template <size_t Rank>
+struct bin_source {
+	template <typename Histogram>
+	bin_source(const Histogram &hist)
+	    : bincontent(hist.bincontent()), squaredweights(hist.squaredweights()),
+	      edges(hist.edges())
+	{
+		stride[Rank-1] = 1;
+		for (size_t i=Rank-1; i > 0; i--)
+			stride[i-1] = stride[i]*bincontent.shape_[i];
+	}
+
+	view<double, Rank> bincontent, squaredweights;
+	std::array<span<const double>, Rank> edges;
+	std::array<size_t, Rank> stride;
+};
+
+}
+
+/**
+ * @brief One bin, as seen through a bin_iterator
+ *
+ * Indices count from the underflow bin, so bin i of an axis lies between
+ * edges i and i+1 of that axis as returned by edges().
+ */
+template <size_t Rank>
+class bin_ref {
+public:
+	/** Per-axis indices */
+	const std::array<size_t, Rank>& index() const { return coords_; }
+	size_t index(size_t axis) const { return coords_[axis]; }
+	/** Offset in the row-major bin arrays */
+	size_t offset() const { return offset_; }
+
+	double content() const { return source_->bincontent.data_[offset_]; }
+	double sumw2() const { return source_->squaredweights.data_[offset_]; }
+
+	double lower(size_t axis) const { return source_->edges[axis][coords_[axis]]; }
+	double upper(size_t axis) const { return source_->edges[axis][coords_[axis]+1]; }
+	/** Midpoint of the edges; infinite for flow bins */
+	double center(size_t axis) const
+	{
+		double lo = lower(axis), hi = upper(axis);
+		return std::isinf(lo) ? lo : std::isinf(hi) ? hi : (lo + hi)/2;
+	}
+
+protected:
+	const detail::bin_source<Rank> *source_;
+	std::array<size_t, Rank> coords_;
+	size_t offset_;
+};
+
+/**
+ * @brief Forward iterator over bins in row-major order
+ *
+ * The per-axis indices are updated incrementally like an odometer, so
+ * that advancing costs one addition in the common case instead of a
+ * division per axis.
+ */
+template <size_t Rank>
+class bin_iterator : private bin_ref<Rank> {
+public:
+	typedef std::forward_iterator_tag iterator_category;
+	typedef bin_ref<Rank> value_type;
+	typedef std::ptrdiff_t difference_type;
+	typedef const bin_ref<Rank>* pointer;
+	typedef const bin_ref<Rank>& reference;
+
+	bin_iterator() {}
+	bin_iterator(const detail::bin_source<Rank> &source, const std::array<size_t, Rank> &first,
+	    const std::array<size_t, Rank> &last, bool end)
+	    : first_(first), last_(last)
+	{
+		this->source_ = &source;
+		this->coords_ = first;
+		for (size_t i=0; i < Rank; i++)
+			if (end || first[i] >= last[i])
+				this->coords_[0] = last[0];
+		this->offset_ = 0;
+		for (size_t i=0; i < Rank; i++)
+			this->offset_ += this->coords_[i]*source.stride[i];
+	}
+
+	reference operator*() const { return *this; }
+	pointer operator->() const { return this; }
+
+	bin_iterator& operator++()
+	{
+		const std::array<size_t, Rank> &stride = this->source_->stride;
+		for (size_t i=Rank; i > 0; i--) {
+			this->offset_ += stride[i-1];
+			if (++this->coords_[i-1] < last_[i-1] || i == 1)
+				break;
+			this->offset_ -= (last_[i-1] - first_[i-1])*stride[i-1];
+			this->coords_[i-1] = first_[i-1];
+		}
+		return *this;
+	}
+
+	bin_iterator operator++(int)
+	{
+		bin_iterator previous(*this);
+		++*this;
+		return previous;
+	}
+
+	bool operator==(const bin_iterator &other) const { return this->offset_ == other.offset_; }
+	bool operator!=(const bin_iterator &other) const { return !(*this == other); }
+
+private:
+	std::array<size_t, Rank> first_, last_;
+};
+
+/**
+ * @brief The bins of a histogram, or a block of them along the first axis
+ *
+ * Holds views of the bin contents, so it stays valid as long as the
+ * histogram does. With a layout other than row-major the contents are
+ * gathered into a row-major copy once, when the range is created.
+ */
+template <size_t Rank>
+class bin_range {
+public:
+	typedef bin_iterator<Rank> iterator;
+	typedef iterator const_iterator;
+
+	template <typename Histogram>
+	bin_range(const Histogram &hist, flow_policy flow=include_flow)
+	    : source_(std::make_shared<detail::bin_source<Rank> >(hist))
+	{
+		const std::array<size_t, Rank> &shape = source_->bincontent.shape_;
+		for (size_t i=0; i < Rank; i++) {
+			first_[i] = (flow == skip_flow) ? 1 : 0;
+			last_[i] = (flow == skip_flow) ? std::max(shape[i], size_t(1))-1 : shape[i];
+		}
+	}
+
+	iterator begin() const { return iterator(*source_, first_, last_, false); }
+	iterator end() const { return iterator(*source_, first_, last_, true); }
+
+	/** Number of bins in the range */
+	size_t size() const
+	{
+		size_t n = 1;
+		for (size_t i=0; i < Rank; i++)
+			n *= last_[i] > first_[i] ? last_[i] - first_[i] : 0;
+		return n;
+	}
+
+	/** Indices along the first axis */
+	size_t first() const { return first_[0]; }
+	size_t last() const { return last_[0]; }
+
+	/** @brief The part of this range with first-axis indices in [begin, end) */
+	bin_range block(size_t begin, size_t end) const
+	{
+		bin_range sub(*this);
+		sub.first_[0] = std::max(begin, first_[0]);
+		sub.last_[0] = std::max(sub.first_[0], std::min(end, last_[0]));
+		return sub;
+	}
+
+private:
+	std::shared_ptr<const detail::bin_source<Rank> > source_;
+	std::array<size_t, Rank> first_, last_;
+};
+
+/**
+ * @brief Iterate over the bins of a histogram
+ *
+ * @code
+ * for (auto &bin : bins(h, skip_flow))
+ *     std::cout << bin.center(0) << " " << bin.content() << std::endl;
+ * @endcode
+ */
+template <typename Histogram>
+auto bins(const Histogram &hist, flow_policy flow=include_flow)
+{
+	return bin_range<std::tuple_size<typename std::decay<decltype(hist.shape())>::type>::value>(hist, flow);
+}
+
+/**
+ * @brief Call f(bin) for every bin, in row-major order
+ */
+template <typename Histogram, typename Function>
+void for_each_bin(const Histogram &hist, Function &&f, flow_policy flow=include_flow)
+{
+	for (auto &bin : bins(hist, flow))
+		f(bin);
+}
+
+/**
+ * @brief Call f(bin) for every bin from n_threads threads
+ *
+ * The first axis is split into contiguous blocks, one per thread, so f
+ * may be called concurrently and in any order across blocks. Within a
+ * block bins are visited in row-major order.
+ */
+template <typename Histogram, typename Function>
+void for_each_bin(const Histogram &hist, Function &&f, size_t n_threads, flow_policy flow=include_flow)
+{
+	auto range = bins(hist, flow);
+	size_t n = range.last() - range.first();
+	n_threads = std::max(size_t(1), std::min(n_threads, n));
+	if (n_threads == 1) {
+		for (auto &bin : range)
+			f(bin);
+		return;
+	}
+	std::vector<std::thread> threads;
+	threads.reserve(n_threads);
+	for (size_t t=0; t < n_threads; t++) {
+		auto block = range.block(range.first() + (t*n)/n_threads,
+		    range.first() + ((t+1)*n)/n_threads);
+		threads.emplace_back([block, &f]() {
+			for (auto &bin : block)
+				f(bin);
+		});
+	}
+	for (std::thread &thread : threads)
+		thread.join();
+}
+
+}
+
+#endif // HISTOGRAM_BINS_H_INCLUDED
@@ -0,0 +1,196 @@
+
+#ifndef HISTOGRAM_COLLECTION_H_INCLUDED
+#define HISTOGRAM_COLLECTION_H_INCLUDED
+
+#include "histogram.h"
+#include "histogram_storage.h"
+
+#include <functional>
+#include <map>
+#include <memory>
+#include <stdexcept>
+
+namespace histogram {
+
+/**
+ * @brief Thrown when a booking would exceed a collection's memory budget
+ */
+class budget_exceeded : public std::runtime_error {
+public:
+	budget_exceeded(size_t requested, size_t used, size_t budget)
+	    : std::runtime_error(message(requested, used, budget)),
+	      requested_(requested), used_(used), budget_(budget)
+	{}
+	size_t requested() const { return requested_; }
+	size_t used() const { return used_; }
+	size_t budget() const { return budget_; }
+private:
+	static std::string message(size_t requested, size_t used, size_t budget)
+	{
+		std::ostringstream ss;
+		ss << "Booking " << requested << " bytes would exceed the memory budget ("
+		    << used << " of " << budget << " bytes in use)";
+		return ss.str();
+	}
+	size_t requested_, used_, budget_;
+};
+
+/**
+ * @brief A set of named histograms sharing a global memory budget
+ *
+ * The size of each histogram is computed from its axes before its bins
+ * are allocated. If a booking would exceed the budget, the collection's
+ * handler is invoked to make room; if there is still not enough room
+ * afterwards, budget_exceeded is thrown.
+ */
+class collection {
+public:
+	/**
+	 * Handler invoked when a booking of the given size does not fit.
+	 * It may release histograms from the collection to make room.
+	 */
+	typedef std::function<void (collection&, size_t)> handler_type;
+
+	/** Handler that refuses the booking immediately */
+	static handler_type fail_fast()
+	{
+		return [](collection &c, size_t requested) {
+			throw budget_exceeded(requested, c.memory_used(), c.budget());
+		};
+	}
+
+	/**
+	 * Handler that saves all resident histograms to the given file and
+	 * then releases them. References to released histograms become
+	 * invalid. Each spill is written to a new group /spill_<n> so that
+	 * successive spills of the same name do not overwrite each other.
+	 */
+	static handler_type spill_to_hdf5(const std::string &fname)
+	{
+		return [fname](collection &c, size_t) {
+			if (c.entries_.empty())
+				return;
+			std::ostringstream where;
+			where << "/spill_" << c.nspills_++;
+			c.save(fname, where.str());
+			c.clear();
+		};
+	}
+
+	/**
+	 * @param[in] budget  maximum number of bytes held by all histograms
+	 * @param[in] handler action to take when a booking does not fit
+	 */
+	explicit collection(size_t budget, handler_type handler=fail_fast())
+	    : budget_(budget), handler_(handler), nspills_(0), used_(0)
+	{}
+
+	/**
+	 * @brief Create a histogram owned by the collection
+	 *
+	 * @returns a reference that stays valid until the histogram is released
+	 * @throws std::invalid_argument if a histogram of that name exists
+	 * @throws budget_exceeded if the histogram does not fit
+	 */
+	template <class... Ts>
+	typename std::enable_if<and_<std::is_base_of<binning::dimension_tag, Ts>... >::value, histogram<Ts...>& >::type
+	book(const std::string &name, Ts...ts)
+	{
+		if (entries_.count(name))
+			throw std::invalid_argument("Histogram " + name + " is already booked");
+		size_t requested = projected_memory_usage(ts...).total();
+		if (memory_used() + requested > budget_) {
+			handler_(*this, requested);
+			if (memory_used() + requested > budget_)
+				throw budget_exceeded(requested, memory_used(), budget_);
+		}
+		std::unique_ptr<entry<histogram<Ts...> > > item(new entry<histogram<Ts...> >(ts..., name));
+		histogram<Ts...> &hist = item->hist;
+		size_t bytes = item->bytes;
+		entries_.emplace(name, std::move(item));
+		used_ += bytes;
+		return hist;
+	}
+
+	/** @brief Look up a histogram by name, returning NULL if not found */
+	template <typename Histogram>
+	Histogram* find(const std::string &name)
+	{
+		auto it = entries_.find(name);
+		if (it == entries_.end())
+			return NULL;
+		auto *item = dynamic_cast<entry<Histogram>*>(it->second.get());
+		return item ? &item->hist : NULL;
+	}
+
+	/** @brief Destroy the named histogram */
+	void release(const std::string &name)
+	{
+		auto it = entries_.find(name);
+		if (it == entries_.end())
+			return;
+		used_ -= it->second->bytes;
+		entries_.erase(it);
+	}
+
+	/** @brief Destroy all histograms */
+	void clear() { entries_.clear(); used_ = 0; }
+
+	size_t size() const { return entries_.size(); }
+	size_t budget() const { return budget_; }
+	void set_budget(size_t budget) { budget_ = budget; }
+	void set_handler(handler_type handler) { handler_ = handler; }
+
+	/** @brief Bytes held by all histograms in the collection */
+	size_t memory_used() const { return used_; }
+
+	/** @brief Bytes held by the named histogram */
+	memory_footprint memory_usage(const std::string &name) const
+	{
+		auto it = entries_.find(name);
+		return it == entries_.end() ? memory_footprint() : it->second->memory_usage();
+	}
+
+	/** @brief Save all histograms as groups under the given path */
+	void save(hdf5::File file, const std::string &where="/")
+	{
+		for (const auto &item : entries_)
+			item.second->save(file, where, item.first);
+	}
+
+	void save(const std::string &fname, const std::string &where="/")
+	{
+		save(hdf5::open_file(fname, hdf5::File::append), where);
+	}
+
+private:
+	struct entry_base {
+		entry_base() : bytes(0) {}
+		virtual ~entry_base() {}
+		virtual memory_footprint memory_usage() const = 0;
+		virtual void save(hdf5::File file, const std::string &where, const std::string &name) const = 0;
+		// Size at booking, as counted against the budget
+		size_t bytes;
+	};
+
+	template <typename Histogram>
+	struct entry : public entry_base {
+		template <typename... Args>
+		entry(Args...args) : hist(args...) { bytes = hist.memory_usage().total(); }
+		memory_footprint memory_usage() const { return hist.memory_usage(); }
+		void save(hdf5::File file, const std::string &where, const std::string &name) const
+		{ ::histogram::save(hist, file, where, name, true); }
+		Histogram hist;
+	};
+
+	size_t budget_;
+	handler_type handler_;
+	size_t nspills_;
+	// Running total of entry bytes, kept by book(), release() and clear()
+	size_t used_;
+	std::map<std::string, std::unique_ptr<entry_base> > entries_;
+};
+
+}
+
+#endif // HISTOGRAM_COLLECTION_H_INCLUDED
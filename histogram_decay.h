@@ -0,0 +1,143 @@
+
+#ifndef HISTOGRAM_DECAY_H_INCLUDED
+#define HISTOGRAM_DECAY_H_INCLUDED
+
+#include "histogram.h"
+
+#include <chrono>
+#include <cmath>
+#include <stdexcept>
+
+namespace histogram {
+
+/**
+ * @brief A histogram whose entries fade away with a given half-life
+ *
+ * Rather than multiplying every bin by the decay factor at each step, the
+ * histogram keeps a global scale that doubles every half-life and adds new
+ * entries with their weight multiplied by the current scale. The true
+ * contents are the stored contents divided by the scale, so a time step
+ * costs O(1) regardless of the number of bins. Only when the scale grows
+ * so large that the squared weights could overflow are the bins divided
+ * by it once and the scale reset to 1.
+ *
+ * Decay is applied when advance() is called, e.g. once per monitoring
+ * tick; entries filled between two calls have the same age.
+ */
+template <class... Dimensions>
+class decaying_histogram {
+public:
+	typedef histogram<Dimensions...> histogram_type;
+	typedef std::chrono::steady_clock clock_type;
+
+	decaying_histogram(clock_type::duration half_life, Dimensions...dims,
+	    const std::string &title=std::string())
+	    : bins_(dims..., title), half_life_(std::chrono::duration<double>(half_life).count()),
+	      scale_(1), reference_(clock_type::now()), latest_(reference_)
+	{
+		if (!(half_life_ > 0))
+			throw std::invalid_argument("Half-life must be positive");
+	}
+
+	size_t ndim() const { return sizeof...(Dimensions); }
+	const std::string& title() const { return bins_.title(); }
+	/** Number of fills, without decay */
+	size_t n_entries() const { return bins_.n_entries(); }
+	/** Factor by which the stored bins exceed the true contents */
+	double scale() const { return scale_; }
+
+	template <typename... Args>
+	bool fill(Args...args) {
+		return fill_with_weight(1., args...);
+	}
+
+	template <typename... Args>
+	bool fill_with_weight(double weight, Args...args) {
+		return bins_.fill_with_weight(weight*scale_, args...);
+	}
+
+	template <typename... Columns>
+	size_t fill_batch(size_t n, const double *weights, const Columns*...columns)
+	{
+		scaled_.resize(n);
+		for (size_t i=0; i < n; i++)
+			scaled_[i] = (weights ? weights[i] : 1.)*scale_;
+		return bins_.fill_batch(n, scaled_.data(), columns...);
+	}
+
+	/** @brief Decay all entries up to the current time */
+	void advance() { advance(clock_type::now()); }
+
+	/**
+	 * @brief Decay all entries up to the given time
+	 *
+	 * Times before the latest one passed are ignored: entries filled
+	 * since then already carry the later scale.
+	 */
+	void advance(clock_type::time_point now)
+	{
+		if (now <= latest_)
+			return;
+		latest_ = now;
+		// Computed from the reference time rather than accumulated, so
+		// that the decay does not depend on how often this is called
+		double age = std::chrono::duration<double>(now - reference_).count();
+		scale_ = std::exp2(age/half_life_);
+		if (scale_ > max_scale()) {
+			bins_.scale(1./scale_);
+			scale_ = 1;
+			reference_ = now;
+		}
+	}
+
+	/** @brief The decayed contents as a new histogram */
+	histogram_type value() const
+	{
+		histogram_type h(bins_);
+		h.scale(1./scale_);
+		return h;
+	}
+
+	// Accessors of the decayed contents, so that the histogram can be
+	// passed to save()
+	std::array<size_t, sizeof...(Dimensions)> shape() const { return bins_.shape(); }
+	std::array<std::vector<double>, sizeof...(Dimensions)> binedges() const { return bins_.binedges(); }
+	std::array<std::string, sizeof...(Dimensions)> labels() const { return bins_.labels(); }
+
+	auto bincontent() const { return scaled(bins_.bincontent(), 1./scale_); }
+	auto squaredweights() const { return scaled(bins_.squaredweights(), 1./(scale_*scale_)); }
+
+private:
+	typedef detail::view<double, sizeof...(Dimensions)> view_type;
+
+	// Squared weights are stored multiplied by the square of the scale,
+	// so keep it well below the square root of the largest double
+	static double max_scale() { return std::ldexp(1., 256); }
+
+	view_type scaled(const view_type &v, double factor) const
+	{
+		size_t size = 1;
+		for (size_t n : v.shape_)
+			size *= n;
+		std::vector<double> buffer(v.data_, v.data_ + size);
+		for (double &x : buffer)
+			x *= factor;
+		return view_type(std::move(buffer), v.shape_);
+	}
+
+	histogram_type bins_;
+	double half_life_;
+	double scale_;
+	clock_type::time_point reference_, latest_;
+	std::vector<double> scaled_;
+};
+
+template <class... Ts>
+std::string axis_signature(const decaying_histogram<Ts...> &)
+{
+	return detail::axis_signature<Ts...>();
+}
+
+}
+
+#endif // HISTOGRAM_DECAY_H_INCLUDED
@@ -0,0 +1,187 @@
+
+#ifndef HISTOGRAM_MMAP_H_INCLUDED
+#define HISTOGRAM_MMAP_H_INCLUDED
+
+#include "histogram.h"
+
+#include <sys/mman.h>
+
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <type_traits>
+
+namespace histogram {
+
+enum page_policy {
+	/** Ask the kernel to back the mapping with transparent huge pages */
+	transparent_huge_pages,
+	/** Map explicit 2 MiB pages from the hugetlb pool, falling back to transparent huge pages */
+	explicit_huge_pages
+};
+
+/**
+ * @brief Allocator backed by anonymous mmap
+ *
+ * Large arrays are mapped directly from the kernel, which hands out zero
+ * pages on first touch, and are aligned to 2 MiB so that they can be
+ * backed by huge pages. Each allocator remembers the part of its latest
+ * allocation that no element has been constructed in yet, which is still
+ * zero, and default construction there is a no-op, so a std::vector<T,
+ * mmap_allocator<T>> of size n costs nothing until its pages are
+ * written. The allocator travels with the memory on move and swap, so
+ * this holds for the container that owns it. Arrays smaller than a huge
+ * page are taken from the heap with 64-byte alignment and zeroed
+ * explicitly.
+ *
+ * @tparam T     element type; must be trivial
+ * @tparam Pages huge page policy
+ */
+template <typename T, page_policy Pages=transparent_huge_pages>
+class mmap_allocator {
+public:
+	static_assert(std::is_trivial<T>::value, "mmap_allocator relies on zero pages being valid objects");
+
+	typedef T value_type;
+	template <typename U>
+	struct rebind { typedef mmap_allocator<U, Pages> other; };
+
+	static constexpr size_t alignment = 64;
+	static constexpr size_t huge_page_size = size_t(2) << 20;
+
+	typedef std::true_type propagate_on_container_move_assignment;
+	typedef std::true_type propagate_on_container_swap;
+
+	mmap_allocator() : fresh_begin_(NULL), fresh_end_(NULL) {}
+	template <typename U>
+	mmap_allocator(const mmap_allocator<U, Pages>&) : fresh_begin_(NULL), fresh_end_(NULL) {}
+
+	T* allocate(size_t n)
+	{
+		size_t bytes = n*sizeof(T);
+		void *p;
+		if (bytes < huge_page_size) {
+			if (posix_memalign(&p, alignment, round_up(bytes, alignment)) != 0)
+				throw std::bad_alloc();
+			std::memset(p, 0, bytes);
+		} else {
+			p = map(round_up(bytes, huge_page_size));
+		}
+		fresh_begin_ = static_cast<const char*>(p);
+		fresh_end_ = fresh_begin_ + bytes;
+		return static_cast<T*>(p);
+	}
+
+	void deallocate(T *p, size_t n)
+	{
+		size_t bytes = n*sizeof(T);
+		const char *begin = reinterpret_cast<const char*>(p);
+		if (fresh_begin_ < begin+bytes && fresh_end_ > begin)
+			fresh_begin_ = fresh_end_ = NULL;
+		if (bytes < huge_page_size)
+			std::free(p);
+		else
+			munmap(p, round_up(bytes, huge_page_size));
+	}
+
+	/**
+	 * Default construction leaves memory that is still zero from
+	 * allocate() untouched, and value-initializes like std::allocator
+	 * otherwise, e.g. for elements reused after a resize() or clear()
+	 */
+	template <typename U>
+	void construct(U *p)
+	{
+		if (!claim(p, sizeof(U)))
+			::new(static_cast<void*>(p)) U();
+	}
+
+	template <typename U, typename... Args>
+	void construct(U *p, Args&&...args)
+	{
+		claim(p, sizeof(U));
+		::new(static_cast<void*>(p)) U(std::forward<Args>(args)...);
+	}
+
+	template <typename U>
+	void destroy(U *) {}
+
+	bool operator==(const mmap_allocator&) const { return true; }
+	bool operator!=(const mmap_allocator&) const { return false; }
+
+private:
+	// Mark [p, p+bytes) as constructed, returning whether it was still
+	// fresh. Containers construct elements in order, so the fresh range
+	// stays exact in the common case.
+	bool claim(const void *p, size_t bytes)
+	{
+		const char *begin = static_cast<const char*>(p);
+		if (begin+bytes <= fresh_begin_ || begin >= fresh_end_)
+			return false;
+		bool fresh = begin >= fresh_begin_;
+		fresh_begin_ = begin+bytes;
+		return fresh;
+	}
+
+	static size_t round_up(size_t value, size_t granularity)
+	{
+		return ((value + granularity - 1)/granularity)*granularity;
+	}
+
+	static void* map(size_t bytes)
+	{
+#if defined(MAP_HUGETLB) && defined(MAP_HUGE_SHIFT)
+		if (Pages == explicit_huge_pages) {
+			void *p = mmap(NULL, bytes, PROT_READ|PROT_WRITE,
+			    MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB|(21 << MAP_HUGE_SHIFT), -1, 0);
+			if (p != MAP_FAILED)
+				return p;
+		}
+#endif
+		// Over-allocate so that the returned region can start on a huge
+		// page boundary, then give back the slop on either side.
+		size_t length = bytes + huge_page_size;
+		void *raw = mmap(NULL, length, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+		if (raw == MAP_FAILED)
+			throw std::bad_alloc();
+		char *begin = static_cast<char*>(raw);
+		char *aligned = reinterpret_cast<char*>(round_up(reinterpret_cast<size_t>(begin), huge_page_size));
+		if (aligned > begin)
+			munmap(begin, aligned-begin);
+		if (begin+length > aligned+bytes)
+			munmap(aligned+bytes, (begin+length)-(aligned+bytes));
+#ifdef MADV_HUGEPAGE
+		madvise(aligned, bytes, MADV_HUGEPAGE);
+#endif
+		return aligned;
+	}
+
+	const char *fresh_begin_, *fresh_end_;
+};
+
+namespace detail {
+
+// Only with transparent huge pages: explicit huge pages can't be given
+// back in base-page units, and madvise() would round the length down to
+// a whole huge page.
+template <typename T>
+struct discardable_pages<mmap_allocator<T, transparent_huge_pages> > : std::true_type {
+	static_assert(mmap_allocator<T>::huge_page_size <= discard_threshold,
+	    "Arrays zeroed by discarding pages must come from mmap()");
+};
+
+}
+
+/** @brief Bins in lazily zeroed memory backed by transparent huge pages */
+struct huge_page_traits : default_traits {
+	typedef mmap_allocator<double> allocator_type;
+};
+
+/** @brief Bins in lazily zeroed memory backed by explicit 2 MiB pages, if available */
+struct hugetlb_traits : default_traits {
+	typedef mmap_allocator<double, explicit_huge_pages> allocator_type;
+};
+
+}
+
+#endif // HISTOGRAM_MMAP_H_INCLUDED
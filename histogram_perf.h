@@ -0,0 +1,363 @@
+
+#ifndef HISTOGRAM_PERF_H_INCLUDED
+#define HISTOGRAM_PERF_H_INCLUDED
+
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <cstdint>
+#include <cstring>
+#include <array>
+#include <map>
+#include <mutex>
+#include <string>
+#include <ostream>
+#include <utility>
+
+namespace histogram {
+
+/**
+ * @brief Hardware performance counters for fill and save regions
+ *
+ * Counters are read with perf_event_open(2) at the beginning and end of a
+ * region and the difference is attributed both to the histogram and to
+ * its combination of axis types. Histograms are told apart by address,
+ * so that histograms with the same title are not lumped together, and
+ * are labelled with their title.
+ *
+ * Reading the counters costs a system call on each side, so wrap loops
+ * of fills rather than individual calls. For the same reason only
+ * histogram::fill_batch() and save() are instrumented automatically when
+ * HISTOGRAM_PERF_COUNTERS is defined; single fill() and
+ * fill_with_weight() calls are not measured unless the caller wraps them
+ * in measure().
+ *
+ * Events that the kernel refuses to open (e.g. hardware events inside a
+ * virtual machine) are reported as zero; see counter_group::available().
+ */
+namespace perf {
+
+enum event {
+	task_clock,
+	cycles,
+	instructions,
+	l1d_misses,
+	llc_misses,
+	branch_misses,
+	num_events
+};
+
+inline const char* event_name(int e)
+{
+	static const char *names[num_events] = {
+		"task_clock", "cycles", "instructions", "l1d_misses", "llc_misses", "branch_misses"
+	};
+	return names[e];
+}
+
+/** @brief Accumulated counts for one region */
+struct counts {
+	counts() : calls(0) { values.fill(0); }
+
+	counts& operator+=(const counts &other)
+	{
+		calls += other.calls;
+		for (int i=0; i < num_events; i++)
+			values[i] += other.values[i];
+		return *this;
+	}
+
+	uint64_t operator[](event e) const { return values[e]; }
+
+	uint64_t calls;
+	std::array<uint64_t, num_events> values;
+};
+
+/**
+ * @brief A group of counters measuring the calling thread
+ */
+class counter_group {
+public:
+	counter_group() : leader_(-1), nopen_(0)
+	{
+		fds_.fill(-1);
+		slot_.fill(-1);
+		for (int e=0; e < num_events; e++) {
+			perf_event_attr attr;
+			std::memset(&attr, 0, sizeof(attr));
+			attr.size = sizeof(attr);
+			configure(event(e), attr);
+			attr.exclude_kernel = 1;
+			attr.exclude_hv = 1;
+			attr.read_format = PERF_FORMAT_GROUP;
+			int fd = syscall(SYS_perf_event_open, &attr, 0, -1, leader_, 0);
+			if (fd < 0)
+				continue;
+			if (leader_ < 0)
+				leader_ = fd;
+			fds_[e] = fd;
+			slot_[e] = nopen_++;
+		}
+	}
+	~counter_group()
+	{
+		for (int fd : fds_)
+			if (fd >= 0)
+				close(fd);
+	}
+	counter_group(const counter_group&) = delete;
+	counter_group& operator=(const counter_group&) = delete;
+
+	/** @brief Was the given event opened successfully? */
+	bool available(event e) const { return fds_[e] >= 0; }
+
+	/** @brief Read the current value of all counters */
+	counts read() const
+	{
+		counts c;
+		if (leader_ < 0)
+			return c;
+		uint64_t buffer[num_events+1];
+		if (::read(leader_, buffer, sizeof(buffer)) < ssize_t(sizeof(uint64_t)))
+			return c;
+		for (int e=0; e < num_events; e++)
+			if (slot_[e] >= 0 && uint64_t(slot_[e]) < buffer[0])
+				c.values[e] = buffer[slot_[e]+1];
+		return c;
+	}
+
+	/** @brief The counters of the calling thread */
+	static counter_group& this_thread()
+	{
+		static thread_local counter_group group;
+		return group;
+	}
+
+private:
+	static void configure(event e, perf_event_attr &attr)
+	{
+		switch (e) {
+		case task_clock:
+			attr.type = PERF_TYPE_SOFTWARE;
+			attr.config = PERF_COUNT_SW_TASK_CLOCK;
+			break;
+		case cycles:
+			attr.type = PERF_TYPE_HARDWARE;
+			attr.config = PERF_COUNT_HW_CPU_CYCLES;
+			break;
+		case instructions:
+			attr.type = PERF_TYPE_HARDWARE;
+			attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+			break;
+		case l1d_misses:
+			attr.type = PERF_TYPE_HW_CACHE;
+			attr.config = PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8)
+			    | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+			break;
+		case llc_misses:
+			attr.type = PERF_TYPE_HW_CACHE;
+			attr.config = PERF_COUNT_HW_CACHE_LL | (PERF_COUNT_HW_CACHE_OP_READ << 8)
+			    | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+			break;
+		case branch_misses:
+			attr.type = PERF_TYPE_HARDWARE;
+			attr.config = PERF_COUNT_HW_BRANCH_MISSES;
+			break;
+		default:
+			break;
+		}
+	}
+
+	int leader_, nopen_;
+	std::array<int, num_events> fds_, slot_;
+};
+
+/**
+ * @brief Process-wide store of counts per histogram and per axis signature
+ *
+ * Histograms are keyed by address. A histogram created at the address of
+ * one that was destroyed continues its entry, under the newer label.
+ */
+class registry {
+public:
+	typedef std::map<std::string, counts> region_map;
+
+	static registry& instance()
+	{
+		static registry reg;
+		return reg;
+	}
+
+	void record(const void *histogram, const std::string &label, const std::string &axes,
+	    const std::string &region, const counts &c)
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		labelled &entry = histograms_[histogram];
+		entry.label = label;
+		entry.regions[region] += c;
+		axes_[axes][region] += c;
+	}
+
+	/** @brief Counts for each region of the histogram at the given address */
+	region_map by_address(const void *histogram) const
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		auto it = histograms_.find(histogram);
+		return it == histograms_.end() ? region_map() : it->second.regions;
+	}
+
+	/** @brief Counts for each region, summed over histograms with the given label */
+	region_map histogram(const std::string &label) const
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		region_map sum;
+		for (const auto &entry : histograms_)
+			if (entry.second.label == label)
+				for (const auto &region : entry.second.regions)
+					sum[region.first] += region.second;
+		return sum;
+	}
+
+	/** @brief Counts for each region, summed over histograms with the given axis signature */
+	region_map axes(const std::string &signature) const
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		auto it = axes_.find(signature);
+		return it == axes_.end() ? region_map() : it->second;
+	}
+
+	void clear()
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		histograms_.clear();
+		axes_.clear();
+	}
+
+	/**
+	 * @brief Write all counts as a JSON object
+	 *
+	 * Histograms are listed as an array of objects with the label and
+	 * the counts of each region, since labels need not be unique.
+	 */
+	void dump_json(std::ostream &out) const
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		out << "{\"histograms\": [";
+		for (auto entry = histograms_.begin(); entry != histograms_.end(); entry++) {
+			if (entry != histograms_.begin())
+				out << ", ";
+			out << "{\"label\": ";
+			quote(out, entry->second.label);
+			out << ", \"regions\": ";
+			dump(out, entry->second.regions);
+			out << "}";
+		}
+		out << "], \"axes\": {";
+		for (auto entry = axes_.begin(); entry != axes_.end(); entry++) {
+			if (entry != axes_.begin())
+				out << ", ";
+			quote(out, entry->first);
+			out << ": ";
+			dump(out, entry->second);
+		}
+		out << "}}";
+	}
+
+private:
+	registry() {}
+
+	struct labelled {
+		std::string label;
+		region_map regions;
+	};
+
+	static void quote(std::ostream &out, const std::string &s)
+	{
+		out << '"';
+		for (char c : s) {
+			if (c == '"' || c == '\\')
+				out << '\\' << c;
+			else if (static_cast<unsigned char>(c) < 0x20)
+				out << "\\u00" << "0123456789abcdef"[(c >> 4) & 0xf] << "0123456789abcdef"[c & 0xf];
+			else
+				out << c;
+		}
+		out << '"';
+	}
+
+	static void dump(std::ostream &out, const region_map &regions)
+	{
+		out << "{";
+		for (auto region = regions.begin(); region != regions.end(); region++) {
+			if (region != regions.begin())
+				out << ", ";
+			quote(out, region->first);
+			out << ": {\"calls\": " << region->second.calls;
+			for (int e=0; e < num_events; e++)
+				out << ", \"" << event_name(e) << "\": " << region->second.values[e];
+			out << "}";
+		}
+		out << "}";
+	}
+
+	mutable std::mutex mutex_;
+	std::map<const void*, labelled> histograms_;
+	std::map<std::string, region_map> axes_;
+};
+
+/**
+ * @brief Measure the enclosing scope and record it in the registry
+ */
+class scope {
+public:
+	scope(const void *histogram, const std::string &label, const std::string &axes,
+	    const std::string &region)
+	    : histogram_(histogram), label_(label), axes_(axes), region_(region),
+	      start_(counter_group::this_thread().read())
+	{}
+	scope(scope &&other)
+	    : histogram_(other.histogram_), label_(std::move(other.label_)),
+	      axes_(std::move(other.axes_)), region_(std::move(other.region_)), start_(other.start_)
+	{ other.region_.clear(); }
+	~scope()
+	{
+		if (region_.empty())
+			return;
+		counts stop = counter_group::this_thread().read();
+		stop.calls = 1;
+		for (int e=0; e < num_events; e++)
+			stop.values[e] -= start_.values[e];
+		registry::instance().record(histogram_, label_, axes_, region_, stop);
+	}
+private:
+	const void *histogram_;
+	std::string label_, axes_, region_;
+	counts start_;
+};
+
+/**
+ * @brief Measure a region operating on the given histogram
+ *
+ * @param[in] hist   the histogram
+ * @param[in] region name of the region, e.g. "fill" or "save"
+ * @param[in] label  label of the histogram's entry in the registry.
+ *                   Defaults to the histogram's title.
+ */
+template <typename Histogram>
+scope measure(const Histogram &hist, const std::string &region, const std::string &label)
+{
+	return scope(&hist, label, axis_signature(hist), region);
+}
+
+template <typename Histogram>
+scope measure(const Histogram &hist, const std::string &region)
+{
+	return measure(hist, region, hist.title());
+}
+
+}
+
+}
+
+#endif // HISTOGRAM_PERF_H_INCLUDED
@@ -0,0 +1,118 @@
+
+#ifndef HISTOGRAM_POOL_H_INCLUDED
+#define HISTOGRAM_POOL_H_INCLUDED
+
+#include "histogram.h"
+
+#include <memory>
+#include <mutex>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+namespace histogram {
+
+/**
+ * @brief Recycles identically binned histograms
+ *
+ * acquire() hands out an empty histogram with the binning and title of
+ * the prototype, reusing one that was released before if there is one.
+ * Only the prototype's axes and title are kept, not its bins.
+ * Handles give their histogram back to the pool when they are destroyed;
+ * it is reset() then, so that the cost of clearing is paid once per
+ * reuse and no bin storage is allocated in steady state.
+ *
+ * The pool may be shared between threads. It must outlive its handles.
+ */
+template <typename Histogram>
+class histogram_pool {
+public:
+	class recycler {
+	public:
+		recycler(histogram_pool *pool=nullptr) : pool_(pool) {}
+		void operator()(Histogram *hist) const
+		{
+			if (pool_)
+				pool_->release(hist);
+			else
+				delete hist;
+		}
+	private:
+		histogram_pool *pool_;
+	};
+	typedef std::unique_ptr<Histogram, recycler> handle;
+
+	/**
+	 * @param[in] prototype histogram whose binning and title to copy
+	 * @param[in] reserve   number of empty histograms to create up front
+	 */
+	explicit histogram_pool(const Histogram &prototype, size_t reserve=0)
+	    : axes_(prototype.axes()), title_(prototype.title())
+	{
+		free_.reserve(reserve);
+		for (size_t i=0; i < reserve; i++)
+			free_.emplace_back(create());
+	}
+
+	histogram_pool(const histogram_pool&) = delete;
+	histogram_pool& operator=(const histogram_pool&) = delete;
+
+	/** @brief An empty histogram, recycled if possible */
+	handle acquire()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			if (!free_.empty()) {
+				std::unique_ptr<Histogram> hist(std::move(free_.back()));
+				free_.pop_back();
+				return handle(hist.release(), recycler(this));
+			}
+		}
+		return handle(create(), recycler(this));
+	}
+
+	/** Number of histograms waiting to be reused */
+	size_t n_free() const
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		return free_.size();
+	}
+
+	/** @brief Free the histograms waiting to be reused */
+	void shrink()
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		free_.clear();
+	}
+
+private:
+	void release(Histogram *hist)
+	{
+		std::unique_ptr<Histogram> owned(hist);
+		owned->reset();
+		owned->set_title(title_);
+		std::lock_guard<std::mutex> lock(mutex_);
+		free_.push_back(std::move(owned));
+	}
+
+	Histogram* create() const
+	{
+		return create(std::make_index_sequence<std::tuple_size<axes_type>::value>());
+	}
+
+	template <size_t... I>
+	Histogram* create(std::index_sequence<I...>) const
+	{
+		return new Histogram(std::get<I>(axes_)..., title_);
+	}
+
+	typedef decltype(std::declval<const Histogram&>().axes()) axes_type;
+	axes_type axes_;
+	std::string title_;
+	mutable std::mutex mutex_;
+	std::vector<std::unique_ptr<Histogram> > free_;
+};
+
+}
+
+#endif // HISTOGRAM_POOL_H_INCLUDED
@@ -0,0 +1,197 @@
+
+#ifndef HISTOGRAM_ROLLING_H_INCLUDED
+#define HISTOGRAM_ROLLING_H_INCLUDED
+
+#include "histogram.h"
+
+#include <chrono>
+#include <stdexcept>
+
+namespace histogram {
+
+/**
+ * @brief The distribution of the most recent fills, in a sliding window
+ *
+ * The window is a ring of K slots, each a histogram of the same binning.
+ * Fills go to the newest slot. When the slot's period ends (after a fixed
+ * time or a fixed number of entries) the ring rotates: the newest slot is
+ * added to a running total of the complete slots, the oldest slot is
+ * subtracted from it, zeroed and reused as the newest. Reading the window
+ * costs one addition per bin, independent of K, and rotating costs three
+ * passes over one slot.
+ *
+ * With unit weights the running total is exact; with general weights it
+ * accumulates rounding error of the order of the largest bin content times
+ * the machine epsilon per rotation.
+ */
+template <class... Dimensions>
+class rolling_histogram {
+public:
+	typedef histogram<Dimensions...> histogram_type;
+	typedef std::chrono::steady_clock clock_type;
+
+	/**
+	 * @brief A window of slots*period, rotating on a timer
+	 */
+	rolling_histogram(size_t slots, clock_type::duration period, Dimensions...dims,
+	    const std::string &title=std::string())
+	    : period_(period), entries_per_slot_(0), next_rotation_(clock_type::now() + period),
+	      total_(dims..., title), current_(0)
+	{
+		if (period <= clock_type::duration::zero())
+			throw std::invalid_argument("Slot period must be positive");
+		init(slots);
+	}
+
+	/**
+	 * @brief A window of the last slots*entries fills (to within one
+	 *        slot), rotating after every entries fills
+	 */
+	rolling_histogram(size_t slots, size_t entries, Dimensions...dims,
+	    const std::string &title=std::string())
+	    : period_(clock_type::duration::zero()), entries_per_slot_(entries),
+	      total_(dims..., title), current_(0)
+	{
+		if (entries == 0)
+			throw std::invalid_argument("Slots must hold at least one entry");
+		init(slots);
+	}
+
+	size_t ndim() const { return sizeof...(Dimensions); }
+	const std::string& title() const { return total_.title(); }
+	size_t n_slots() const { return ring_.size(); }
+
+	template <typename... Args>
+	bool fill(Args...args) {
+		return fill_with_weight(1., args...);
+	}
+
+	template <typename... Args>
+	bool fill_with_weight(double weight, Args...args) {
+		advance();
+		return ring_[current_].fill_with_weight(weight, args...);
+	}
+
+	/**
+	 * @brief Fill entries from arrays of coordinates
+	 *
+	 * With time-based rotation the whole batch goes into the current slot;
+	 * with count-based rotation it is split at slot boundaries.
+	 */
+	template <typename... Columns>
+	size_t fill_batch(size_t n, const double *weights, const Columns*...columns)
+	{
+		if (entries_per_slot_ == 0) {
+			advance();
+			return ring_[current_].fill_batch(n, weights, columns...);
+		}
+		size_t accepted = 0;
+		for (size_t i=0; i < n; ) {
+			advance();
+			size_t room = entries_per_slot_ - ring_[current_].n_entries();
+			size_t m = std::min(room, n-i);
+			accepted += ring_[current_].fill_batch(m, weights ? weights+i : NULL, (columns+i)...);
+			i += m;
+		}
+		return accepted;
+	}
+
+	/**
+	 * @brief Start a new slot, dropping the oldest
+	 */
+	void rotate()
+	{
+		total_ += ring_[current_];
+		current_ = (current_ + 1) % ring_.size();
+		total_ -= ring_[current_];
+		ring_[current_].reset();
+	}
+
+	/** @brief Rotate as often as the clock or the entry count demands */
+	void advance() { advance(clock_type::now()); }
+
+	void advance(clock_type::time_point now)
+	{
+		if (entries_per_slot_ > 0) {
+			if (ring_[current_].n_entries() >= entries_per_slot_)
+				rotate();
+			return;
+		}
+		if (now < next_rotation_)
+			return;
+		size_t elapsed = 1 + (now - next_rotation_)/period_;
+		if (elapsed >= ring_.size()) {
+			// The whole window has expired
+			for (histogram_type &slot : ring_)
+				slot.reset();
+			total_.reset();
+		} else {
+			for (size_t i=0; i < elapsed; i++)
+				rotate();
+		}
+		next_rotation_ += elapsed*period_;
+	}
+
+	/** @brief Contents of the whole window as a new histogram */
+	histogram_type window() const
+	{
+		histogram_type sum(total_);
+		sum += ring_[current_];
+		return sum;
+	}
+
+	/** @brief The slot that is being filled */
+	const histogram_type& current() const { return ring_[current_]; }
+
+	/** @brief The slot filled i rotations ago, for i < n_slots() */
+	const histogram_type& slot(size_t i) const
+	{ return ring_[(current_ + ring_.size() - i) % ring_.size()]; }
+
+	// Accessors of the window, so that it can be passed to save()
+	std::array<size_t, sizeof...(Dimensions)> shape() const { return total_.shape(); }
+	std::array<std::vector<double>, sizeof...(Dimensions)> binedges() const { return total_.binedges(); }
+	std::array<std::string, sizeof...(Dimensions)> labels() const { return total_.labels(); }
+	size_t n_entries() const { return total_.n_entries() + ring_[current_].n_entries(); }
+
+	auto bincontent() const { return sum(total_.bincontent(), ring_[current_].bincontent()); }
+	auto squaredweights() const { return sum(total_.squaredweights(), ring_[current_].squaredweights()); }
+
+private:
+	typedef detail::view<double, sizeof...(Dimensions)> view_type;
+
+	void init(size_t slots)
+	{
+		if (slots == 0)
+			throw std::invalid_argument("A rolling histogram needs at least one slot");
+		ring_.assign(slots, total_);
+	}
+
+	view_type sum(const view_type &a, const view_type &b) const
+	{
+		size_t size = 1;
+		for (size_t n : a.shape_)
+			size *= n;
+		std::vector<double> buffer(a.data_, a.data_ + size);
+		for (size_t i=0; i < size; i++)
+			buffer[i] += b.data_[i];
+		return view_type(std::move(buffer), a.shape_);
+	}
+
+	clock_type::duration period_;
+	size_t entries_per_slot_;
+	clock_type::time_point next_rotation_;
+	// Sum of all slots except the current one
+	histogram_type total_;
+	std::vector<histogram_type> ring_;
+	size_t current_;
+};
+
+template <class... Ts>
+std::string axis_signature(const rolling_histogram<Ts...> &)
+{
+	return detail::axis_signature<Ts...>();
+}
+
+}
+
+#endif // HISTOGRAM_ROLLING_H_INCLUDED
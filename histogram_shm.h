@@ -0,0 +1,354 @@
+
+#ifndef HISTOGRAM_SHM_H_INCLUDED
+#define HISTOGRAM_SHM_H_INCLUDED
+
+#include "histogram.h"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <thread>
+
+namespace histogram {
+
+namespace detail {
+
+/**
+ * @brief A mapped POSIX shared-memory object
+ */
+class shm_segment {
+public:
+	shm_segment() : fd_(-1), data_(NULL), size_(0) {}
+
+	/** Create a new object of the given size, failing if it already exists */
+	static shm_segment create(const std::string &name, size_t size)
+	{
+		int fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+		if (fd < 0)
+			throw std::runtime_error("Couldn't create shared memory segment " + name);
+		if (ftruncate(fd, size) != 0) {
+			close(fd);
+			shm_unlink(name.c_str());
+			throw std::runtime_error("Couldn't size shared memory segment " + name);
+		}
+		return shm_segment(name, fd, size);
+	}
+
+	/**
+	 * Map an existing object, waiting until deadline for it to be
+	 * created and sized to at least min_size bytes
+	 */
+	static shm_segment open(const std::string &name, size_t min_size,
+	    std::chrono::steady_clock::time_point deadline)
+	{
+		for (;;) {
+			int fd = shm_open(name.c_str(), O_RDWR, 0600);
+			if (fd < 0 && errno != ENOENT)
+				throw std::runtime_error("Couldn't open shared memory segment " + name);
+			if (fd >= 0) {
+				struct stat st;
+				if (fstat(fd, &st) != 0) {
+					close(fd);
+					throw std::runtime_error("Couldn't stat shared memory segment " + name);
+				}
+				if (size_t(st.st_size) >= min_size)
+					return shm_segment(name, fd, st.st_size);
+				close(fd);
+			}
+			if (std::chrono::steady_clock::now() >= deadline)
+				throw std::runtime_error("Couldn't open shared memory segment " + name);
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		}
+	}
+
+	/** Remove the name; existing mappings stay valid */
+	static void unlink(const std::string &name) { shm_unlink(name.c_str()); }
+
+	shm_segment(shm_segment &&other)
+	    : name_(std::move(other.name_)), fd_(other.fd_), data_(other.data_), size_(other.size_)
+	{
+		other.fd_ = -1;
+		other.data_ = NULL;
+	}
+	shm_segment(const shm_segment&) = delete;
+	shm_segment& operator=(const shm_segment&) = delete;
+	~shm_segment()
+	{
+		if (data_ != NULL)
+			munmap(data_, size_);
+		if (fd_ >= 0)
+			close(fd_);
+	}
+
+	void* data() const { return data_; }
+	size_t size() const { return size_; }
+	const std::string& name() const { return name_; }
+
+private:
+	shm_segment(const std::string &name, int fd, size_t size) : name_(name), fd_(fd), size_(size)
+	{
+		data_ = mmap(NULL, size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+		if (data_ == MAP_FAILED) {
+			data_ = NULL;
+			close(fd_);
+			throw std::runtime_error("Couldn't map shared memory segment " + name);
+		}
+	}
+
+	std::string name_;
+	int fd_;
+	void *data_;
+	size_t size_;
+};
+
+/**
+ * @brief Layout of the beginning of a shared histogram segment
+ *
+ * The bin contents and squared weights follow, each as size doubles,
+ * starting at the next multiple of 64 bytes.
+ */
+struct shm_header {
+	static constexpr uint64_t expected_magic = 0x4d48534948534144ull; // "DASHISHM"
+	static constexpr size_t max_rank = 16;
+	static constexpr size_t max_title = 256;
+
+	uint64_t magic;
+	uint64_t rank;
+	uint64_t size;
+	uint64_t fingerprint;
+	uint64_t shape[max_rank];
+	uint64_t n_entries;
+	char title[max_title];
+
+	template <class... Ts>
+	static size_t nbins(Ts...ts)
+	{
+		size_t n = 1;
+		int expand[] = {0, (n *= ts.nbins(), 0)...};
+		(void)expand;
+		return n;
+	}
+	static size_t data_offset() { return (sizeof(shm_header) + 63) & ~size_t(63); }
+	static size_t array_size(size_t nbins) { return (nbins*sizeof(double) + 63) & ~size_t(63); }
+	static size_t bytes(size_t nbins) { return data_offset() + 2*array_size(nbins); }
+
+	bool published() const { return __atomic_load_n(&magic, __ATOMIC_ACQUIRE) == expected_magic; }
+	void publish() { __atomic_store_n(&magic, expected_magic, __ATOMIC_RELEASE); }
+};
+
+/** @brief A mapped segment that hands out its two bin arrays in turn */
+struct shm_bins {
+	explicit shm_bins(shm_segment &&segment) : segment(std::move(segment)), taken(0) {}
+
+	shm_header* header() const { return static_cast<shm_header*>(segment.data()); }
+
+	bool contains(const void *p) const
+	{
+		const char *begin = static_cast<const char*>(segment.data());
+		return p >= begin && p < begin + segment.size();
+	}
+
+	void* take(size_t bytes)
+	{
+		if (taken >= 2 || bytes != header()->size*sizeof(double))
+			throw std::logic_error("Bins of shared histogram " + segment.name() + " can't be reallocated");
+		char *base = static_cast<char*>(segment.data()) + shm_header::data_offset();
+		return base + (taken++)*shm_header::array_size(header()->size);
+	}
+
+	shm_segment segment;
+	size_t taken;
+};
+
+/**
+ * @brief The entry count of a histogram in shared memory
+ *
+ * Updated atomically in the segment header. Copies hold a private count,
+ * like the copied histogram holds private bins.
+ */
+class shm_entry_count {
+public:
+	explicit shm_entry_count(const std::shared_ptr<shm_bins> &bins)
+	    : value_(0), bins_(bins), shared_(bins ? &bins->header()->n_entries : NULL)
+	{}
+	shm_entry_count(const shm_entry_count &other) : value_(other), shared_(NULL) {}
+	shm_entry_count(shm_entry_count &&other) = default;
+	shm_entry_count& operator=(const shm_entry_count &other) { return *this = size_t(other); }
+
+	operator size_t() const { return __atomic_load_n(location(), __ATOMIC_RELAXED); }
+	shm_entry_count& operator=(size_t n) { __atomic_store_n(location(), n, __ATOMIC_RELAXED); return *this; }
+	shm_entry_count& operator+=(size_t n) { __atomic_fetch_add(location(), n, __ATOMIC_RELAXED); return *this; }
+	shm_entry_count& operator-=(size_t n) { __atomic_fetch_sub(location(), n, __ATOMIC_RELAXED); return *this; }
+	void operator++(int) { *this += 1; }
+
+private:
+	uint64_t* location() const { return shared_ ? shared_ : &value_; }
+
+	mutable uint64_t value_;
+	std::shared_ptr<shm_bins> bins_;
+	uint64_t *shared_;
+};
+
+}
+
+/**
+ * @brief Allocator that places the bins of a histogram in a POSIX
+ *        shared-memory segment
+ *
+ * Made by create_shared() and attach_shared(), which set up the segment
+ * for one histogram: the two bin arrays come from it, in order, and the
+ * entry count lives in its header. Elements in the segment are never
+ * initialized by the allocator, so attaching leaves the bins alone; a new
+ * segment is zero. Copies of a histogram, and a default-constructed
+ * allocator, use private memory.
+ */
+template <typename T>
+class shm_allocator {
+public:
+	typedef T value_type;
+	template <typename U>
+	struct rebind { typedef shm_allocator<U> other; };
+
+	shm_allocator() {}
+	explicit shm_allocator(const std::shared_ptr<detail::shm_bins> &bins) : bins_(bins) {}
+	template <typename U>
+	shm_allocator(const shm_allocator<U> &other) : bins_(other.bins()) {}
+
+	T* allocate(size_t n)
+	{
+		if (bins_)
+			return static_cast<T*>(bins_->take(n*sizeof(T)));
+		return std::allocator<T>().allocate(n);
+	}
+
+	void deallocate(T *p, size_t n)
+	{
+		if (!(bins_ && bins_->contains(p)))
+			std::allocator<T>().deallocate(p, n);
+	}
+
+	template <typename U, typename... Args>
+	void construct(U *p, Args&&...args)
+	{
+		if (!(sizeof...(Args) == 0 && bins_ && bins_->contains(p)))
+			::new(static_cast<void*>(p)) U(std::forward<Args>(args)...);
+	}
+
+	shm_allocator select_on_container_copy_construction() const { return shm_allocator(); }
+
+	const std::shared_ptr<detail::shm_bins>& bins() const { return bins_; }
+
+	bool operator==(const shm_allocator &other) const { return bins_ == other.bins_; }
+	bool operator!=(const shm_allocator &other) const { return bins_ != other.bins_; }
+
+private:
+	std::shared_ptr<detail::shm_bins> bins_;
+};
+
+namespace detail {
+
+template <>
+struct entry_counter<shm_allocator<double> > {
+	typedef shm_entry_count type;
+	static type make(const shm_allocator<double> &allocator) { return type(allocator.bins()); }
+};
+
+}
+
+/**
+ * @brief Storage in POSIX shared memory, filled atomically
+ *
+ * Any number of processes may attach to the same segment by name and
+ * fill it concurrently; each fill is a pair of atomic additions to the
+ * bins and an atomic increment of the entry count. Fill statistics and
+ * dirty-block tracking, if enabled, are private to each process.
+ */
+struct shared_traits : default_traits {
+	typedef shm_allocator<double> allocator_type;
+	typedef sync::atomic sync_type;
+};
+
+template <class... Dimensions>
+using shared_histogram = basic_histogram<shared_traits, Dimensions...>;
+
+/**
+ * @brief Create a histogram in a new shared-memory segment
+ *
+ * @throws std::runtime_error if a segment with that name exists
+ */
+template <class... Ts>
+typename std::enable_if<and_<std::is_base_of<binning::dimension_tag, Ts>... >::value, shared_histogram<Ts...> >::type
+create_shared(const std::string &name, const std::string &title, Ts...ts)
+{
+	static_assert(sizeof...(Ts) <= detail::shm_header::max_rank, "Too many dimensions");
+	const size_t nbins = detail::shm_header::nbins(ts...);
+	auto bins = std::make_shared<detail::shm_bins>(
+	    detail::shm_segment::create(name, detail::shm_header::bytes(nbins)));
+	detail::shm_header *header = bins->header();
+	header->size = nbins;
+	shared_histogram<Ts...> hist(shm_allocator<double>(bins), ts..., title);
+	auto shape = hist.shape();
+	header->rank = sizeof...(Ts);
+	header->fingerprint = binning_fingerprint(hist);
+	std::copy(shape.begin(), shape.end(), header->shape);
+	std::strncpy(header->title, title.c_str(), detail::shm_header::max_title-1);
+	// Publish only once the header is complete
+	header->publish();
+	return hist;
+}
+
+/**
+ * @brief Attach to a histogram in an existing shared-memory segment
+ *
+ * Waits up to timeout for the segment to be created and published.
+ *
+ * @throws std::runtime_error if it does not appear in time or its
+ *         binning differs
+ */
+template <class... Ts>
+typename std::enable_if<and_<std::is_base_of<binning::dimension_tag, Ts>... >::value, shared_histogram<Ts...> >::type
+attach_shared(const std::string &name, std::chrono::milliseconds timeout, Ts...ts)
+{
+	const size_t nbins = detail::shm_header::nbins(ts...);
+	auto deadline = std::chrono::steady_clock::now() + timeout;
+	auto bins = std::make_shared<detail::shm_bins>(
+	    detail::shm_segment::open(name, detail::shm_header::data_offset(), deadline));
+	detail::shm_header *header = bins->header();
+	while (!header->published()) {
+		if (std::chrono::steady_clock::now() >= deadline)
+			throw std::runtime_error("Segment " + name + " does not hold a histogram");
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+	if (header->rank != sizeof...(Ts) || header->size != nbins
+	    || bins->segment.size() < detail::shm_header::bytes(nbins))
+		throw std::runtime_error("Segment " + name + " has a different binning");
+	std::string title(header->title, strnlen(header->title, detail::shm_header::max_title));
+	shared_histogram<Ts...> hist(shm_allocator<double>(bins), ts..., title);
+	auto shape = hist.shape();
+	if (!std::equal(shape.begin(), shape.end(), header->shape)
+	    || header->fingerprint != binning_fingerprint(hist))
+		throw std::runtime_error("Segment " + name + " has a different binning");
+	return hist;
+}
+
+template <class... Ts>
+typename std::enable_if<and_<std::is_base_of<binning::dimension_tag, Ts>... >::value, shared_histogram<Ts...> >::type
+attach_shared(const std::string &name, Ts...ts)
+{
+	return attach_shared(name, std::chrono::milliseconds(10000), ts...);
+}
+
+/** @brief Remove a segment's name; attached processes keep their mappings */
+inline void unlink_shared(const std::string &name) { detail::shm_segment::unlink(name); }
+
+}
+
+#endif // HISTOGRAM_SHM_H_INCLUDED
@@ -0,0 +1,205 @@
+
+#ifndef HISTOGRAM_SIMD_H_INCLUDED
+#define HISTOGRAM_SIMD_H_INCLUDED
+
+#include <cstddef>
+#include <cstdint>
+#include <cmath>
+#include <algorithm>
+
+#if !defined(HISTOGRAM_NO_SIMD) && defined(__x86_64__) && defined(__GNUC__)
+#define HISTOGRAM_HAVE_AVX512 1
+#include <immintrin.h>
+#endif
+
+namespace histogram {
+
+namespace detail {
+
+/**
+ * @brief Vectorized kernels with runtime CPU dispatch
+ *
+ * Each kernel checks once whether the CPU supports the required
+ * instructions and otherwise falls back to an equivalent scalar loop.
+ * Define HISTOGRAM_NO_SIMD to compile only the scalar versions.
+ */
+namespace simd {
+
+/** @brief Does the CPU support AVX-512F and AVX-512CD? */
+inline bool have_avx512()
+{
+#ifdef HISTOGRAM_HAVE_AVX512
+	static const bool have = __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512cd");
+	return have;
+#else
+	return false;
+#endif
+}
+
+#ifdef HISTOGRAM_HAVE_AVX512
+
+__attribute__((target("avx512f")))
+inline void uniform_index_avx512(size_t n, const double *values, double min, double max,
+    double offset, double range, double scale, size_t last, size_t *bins)
+{
+	const __m512d vmin = _mm512_set1_pd(min), vmax = _mm512_set1_pd(max);
+	const __m512d voffset = _mm512_set1_pd(offset), vrange = _mm512_set1_pd(range);
+	const __m512d vscale = _mm512_set1_pd(scale);
+	const __m512i one = _mm512_set1_epi64(1), zero = _mm512_setzero_si512();
+	const __m512i vlast = _mm512_set1_epi64(last);
+	size_t i = 0;
+	for (; i+8 <= n; i += 8) {
+		__m512d v = _mm512_loadu_pd(values+i);
+		// Same sequence of operations as uniform::index(), so the results are identical
+		__m512d t = _mm512_mul_pd(vscale, _mm512_div_pd(_mm512_sub_pd(v, voffset), vrange));
+		// The masked forms with explicit sources avoid spurious
+		// -Wmaybe-uninitialized warnings from GCC's intrinsic headers
+		t = _mm512_mask_roundscale_pd(t, 0xff, t, _MM_FROUND_TO_NEG_INF | _MM_FROUND_NO_EXC);
+		__m256i truncated = _mm512_mask_cvttpd_epi32(_mm256_setzero_si256(), 0xff, t);
+		__m512i bin = _mm512_add_epi64(_mm512_mask_cvtepi32_epi64(zero, 0xff, truncated), one);
+		__mmask8 below = _mm512_cmp_pd_mask(v, vmin, _CMP_LT_OQ) | _mm512_cmp_pd_mask(v, v, _CMP_UNORD_Q);
+		__mmask8 above = _mm512_cmp_pd_mask(v, vmax, _CMP_GE_OQ);
+		bin = _mm512_mask_mov_epi64(bin, below, zero);
+		bin = _mm512_mask_mov_epi64(bin, above, vlast);
+		_mm512_storeu_si512(bins+i, bin);
+	}
+	for (; i < n; i++) {
+		double v = values[i];
+		bins[i] = (std::isnan(v) || v < min) ? 0 : (v >= max ? last : size_t(std::floor(scale*((v-offset)/range)))+1);
+	}
+}
+
+__attribute__((target("avx512f,avx512cd")))
+inline void scatter_add_avx512(size_t n, const size_t *offsets, const double *weights,
+    double *sumw, double *sumw2)
+{
+	size_t i = 0;
+	for (; i+8 <= n; i += 8) {
+		__m512i idx = _mm512_loadu_si512(offsets+i);
+		__m512d w = _mm512_loadu_pd(weights+i);
+		__m512d w2 = _mm512_mul_pd(w, w);
+		// Bit j of lane k is set if lane j < k has the same offset
+		__m512i conflicts = _mm512_conflict_epi64(idx);
+		__mmask8 todo = 0xff;
+		while (todo) {
+			// Lanes with no pending duplicates before them have distinct
+			// offsets and can be updated together
+			__mmask8 ready = _mm512_mask_testn_epi64_mask(todo, conflicts, _mm512_set1_epi64(todo));
+			__m512d s = _mm512_mask_i64gather_pd(_mm512_setzero_pd(), ready, idx, sumw, 8);
+			_mm512_mask_i64scatter_pd(sumw, ready, idx, _mm512_add_pd(s, w), 8);
+			__m512d s2 = _mm512_mask_i64gather_pd(_mm512_setzero_pd(), ready, idx, sumw2, 8);
+			_mm512_mask_i64scatter_pd(sumw2, ready, idx, _mm512_add_pd(s2, w2), 8);
+			todo &= ~ready;
+		}
+	}
+	for (; i < n; i++) {
+		sumw[offsets[i]] += weights[i];
+		sumw2[offsets[i]] += weights[i]*weights[i];
+	}
+}
+
+__attribute__((target("avx512f")))
+inline void uniform_index_float_avx512(size_t n, const float *values, float min, float max,
+    float offset, float scale, float guard, size_t last, size_t *bins)
+{
+	const __m512 vmin = _mm512_set1_ps(min), vmax = _mm512_set1_ps(max);
+	const __m512 voffset = _mm512_set1_ps(offset), vscale = _mm512_set1_ps(scale);
+	const __m512 vguard = _mm512_set1_ps(guard), vupper = _mm512_set1_ps(1.f-guard);
+	const __m512i one = _mm512_set1_epi64(1), zero = _mm512_setzero_si512();
+	const __m512i vlast = _mm512_set1_epi64(last), vambiguous = _mm512_set1_epi64(-1);
+	size_t i = 0;
+	for (; i+16 <= n; i += 16) {
+		__m512 v = _mm512_loadu_ps(values+i);
+		__m512 t = _mm512_mul_ps(_mm512_sub_ps(v, voffset), vscale);
+		__m512 floor = _mm512_mask_roundscale_ps(t, 0xffff, t, _MM_FROUND_TO_NEG_INF | _MM_FROUND_NO_EXC);
+		__m512 frac = _mm512_sub_ps(t, floor);
+		__m512i ifloor = _mm512_mask_cvttps_epi32(zero, 0xffff, floor);
+		__mmask16 below = _mm512_cmp_ps_mask(v, vmin, _CMP_LT_OQ) | _mm512_cmp_ps_mask(v, v, _CMP_UNORD_Q);
+		__mmask16 above = _mm512_cmp_ps_mask(v, vmax, _CMP_GE_OQ);
+		__mmask16 ambiguous = (_mm512_cmp_ps_mask(frac, vguard, _CMP_LT_OQ)
+		    | _mm512_cmp_ps_mask(frac, vupper, _CMP_GT_OQ)) & ~(below | above);
+		for (int half=0; half < 2; half++) {
+			__m256i part = half ? _mm512_mask_extracti64x4_epi64(_mm256_setzero_si256(), 0xf, ifloor, 1)
+			    : _mm512_mask_extracti64x4_epi64(_mm256_setzero_si256(), 0xf, ifloor, 0);
+			__m512i bin = _mm512_add_epi64(_mm512_mask_cvtepi32_epi64(zero, 0xff, part), one);
+			bin = _mm512_mask_mov_epi64(bin, __mmask8(below >> (8*half)), zero);
+			bin = _mm512_mask_mov_epi64(bin, __mmask8(above >> (8*half)), vlast);
+			bin = _mm512_mask_mov_epi64(bin, __mmask8(ambiguous >> (8*half)), vambiguous);
+			_mm512_storeu_si512(bins+i+8*half, bin);
+		}
+	}
+	for (; i < n; i++)
+		bins[i] = size_t(-1);
+}
+
+#endif
+
+/**
+ * @brief Single-precision bin indices of a uniform axis with identity
+ *        transformation
+ *
+ * Bins that cannot be decided reliably in single precision, i.e. whose
+ * fractional position lies within guard of a bin edge, are set to
+ * size_t(-1) for the caller to recompute in double precision. Without
+ * AVX-512 every bin is left to the caller.
+ *
+ * @param[in] min    smallest float that is not in the underflow bin
+ * @param[in] max    smallest float that is in the overflow bin
+ * @param[in] scale  bins per unit
+ */
+inline void uniform_index(size_t n, const float *values, float min, float max,
+    float offset, float scale, float guard, size_t last, size_t *bins)
+{
+#ifdef HISTOGRAM_HAVE_AVX512
+	if (have_avx512())
+		return uniform_index_float_avx512(n, values, min, max, offset, scale, guard, last, bins);
+#endif
+	std::fill(bins, bins+n, size_t(-1));
+}
+
+/**
+ * @brief Bin indices of a uniform axis with identity transformation
+ *
+ * Equivalent to uniform<identity>::index() for each value, except that
+ * NaN is assigned bin 0. Axes with 2^31 or more bins use the scalar loop.
+ */
+inline void uniform_index(size_t n, const double *values, double min, double max,
+    double offset, double range, double scale, size_t last, size_t *bins)
+{
+#ifdef HISTOGRAM_HAVE_AVX512
+	// The vector kernel converts bin numbers through int32
+	if (have_avx512() && last < (size_t(1) << 31))
+		return uniform_index_avx512(n, values, min, max, offset, range, scale, last, bins);
+#endif
+	for (size_t i=0; i < n; i++) {
+		double v = values[i];
+		bins[i] = (std::isnan(v) || v < min) ? 0 : (v >= max ? last : size_t(std::floor(scale*((v-offset)/range)))+1);
+	}
+}
+
+/**
+ * @brief Add weights[i] to sumw[offsets[i]] and its square to sumw2[offsets[i]]
+ *
+ * Offsets may repeat; the AVX-512 version resolves duplicates within
+ * each vector with VPCONFLICTQ.
+ */
+inline void scatter_add(size_t n, const size_t *offsets, const double *weights,
+    double *sumw, double *sumw2)
+{
+#ifdef HISTOGRAM_HAVE_AVX512
+	if (have_avx512())
+		return scatter_add_avx512(n, offsets, weights, sumw, sumw2);
+#endif
+	for (size_t i=0; i < n; i++) {
+		sumw[offsets[i]] += weights[i];
+		sumw2[offsets[i]] += weights[i]*weights[i];
+	}
+}
+
+}
+
+}
+
+}
+
+#endif // HISTOGRAM_SIMD_H_INCLUDED
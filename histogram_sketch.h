@@ -0,0 +1,243 @@
+
+#ifndef HISTOGRAM_SKETCH_H_INCLUDED
+#define HISTOGRAM_SKETCH_H_INCLUDED
+
+#include "histogram.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <stdexcept>
+#include <vector>
+
+namespace histogram {
+
+/**
+ * @brief A mergeable streaming quantile sketch (merging t-digest)
+ *
+ * Values are summarized by a sorted list of weighted centroids whose
+ * sizes are bounded by the arcsine scale function, so that they are
+ * small near the tails and at most of order 1/compression of the total
+ * in the middle. Incoming values are buffered and folded in a batch at a
+ * time. Sketches of shards of a data set can be merged with +=, at a
+ * cost that depends only on the compression.
+ *
+ * The main use is to choose bin edges with equal population for a
+ * binning::general axis in the same pass that fills other histograms,
+ * instead of a separate pass over the data.
+ *
+ * The const readers size(), quantile(), edges() and binning() fold
+ * buffered values in first, and so do the arguments of +=. A sketch is
+ * therefore not thread-safe even for reads: concurrent readers must
+ * hold a lock, or share a sketch whose buffer has been folded in by
+ * calling size() once before.
+ */
+class quantile_sketch {
+public:
+	/**
+	 * @param[in] compression bound on the number of centroids, which is
+	 *                        at most compression+1 however many values
+	 *                        are added. Larger values give more accurate
+	 *                        quantiles at the cost of memory and merge
+	 *                        time.
+	 */
+	explicit quantile_sketch(double compression=200)
+	    : compression_(compression), total_(0), unmerged_(0),
+	      min_(std::numeric_limits<double>::infinity()),
+	      max_(-std::numeric_limits<double>::infinity())
+	{
+		if (!(compression >= 10))
+			throw std::invalid_argument("Compression must be at least 10");
+		buffer_.reserve(buffer_size());
+	}
+
+	/** @brief Add a value. NaN values and non-positive weights are ignored. */
+	bool fill_with_weight(double weight, double value)
+	{
+		if (std::isnan(value) || !(weight > 0))
+			return false;
+		buffer_.push_back(centroid{value, weight});
+		unmerged_ += weight;
+		min_ = std::min(min_, value);
+		max_ = std::max(max_, value);
+		if (buffer_.size() >= buffer_size())
+			compress();
+		return true;
+	}
+
+	bool fill(double value) { return fill_with_weight(1., value); }
+
+	/**
+	 * @brief Add values from an array, like histogram::fill_batch()
+	 *
+	 * @param[in] n       number of values
+	 * @param[in] weights array of n weights, or NULL for unit weights
+	 * @param[in] values  array of n values (double or float)
+	 * @returns the number of values accepted
+	 */
+	template <typename Value>
+	size_t fill_batch(size_t n, const double *weights, const Value *values)
+	{
+		size_t accepted = 0;
+		for (size_t i=0; i < n; i++)
+			accepted += fill_with_weight(weights ? weights[i] : 1., double(values[i]));
+		return accepted;
+	}
+
+	/** @brief Merge the summary of another shard into this one */
+	quantile_sketch& operator+=(const quantile_sketch &other)
+	{
+		other.compress();
+		compress();
+		buffer_.insert(buffer_.end(), other.centroids_.begin(), other.centroids_.end());
+		unmerged_ += other.total_;
+		min_ = std::min(min_, other.min_);
+		max_ = std::max(max_, other.max_);
+		compress();
+		return *this;
+	}
+
+	/** Total weight of all values added */
+	double total_weight() const { return total_ + unmerged_; }
+	/** Smallest value added */
+	double min() const { return min_; }
+	/** Largest value added */
+	double max() const { return max_; }
+	/** Number of centroids after folding in buffered values, which modifies the sketch */
+	size_t size() const { compress(); return centroids_.size(); }
+
+	/**
+	 * @brief Estimate the value below which a fraction q of the weight lies
+	 *
+	 * Buffered values are folded in first, which modifies the sketch.
+	 *
+	 * @throws std::logic_error if the sketch is empty
+	 */
+	double quantile(double q) const
+	{
+		compress();
+		if (centroids_.empty())
+			throw std::logic_error("Quantile of an empty sketch");
+		q = std::min(1., std::max(0., q));
+		if (centroids_.size() == 1)
+			return min_ + q*(max_ - min_);
+
+		// Each centroid is taken to be centered on its share of the
+		// cumulative weight; interpolate linearly between centers, and
+		// between the outer centers and the exact extremes.
+		const double target = q*total_;
+		const centroid &first = centroids_.front(), &last = centroids_.back();
+		if (target < first.weight/2)
+			return min_ + (first.mean - min_)*target/(first.weight/2);
+		if (target >= total_ - last.weight/2)
+			return last.mean + (max_ - last.mean)*(target - (total_ - last.weight/2))/(last.weight/2);
+		double center = first.weight/2;
+		for (size_t i=0; i+1 < centroids_.size(); i++) {
+			double next = center + (centroids_[i].weight + centroids_[i+1].weight)/2;
+			if (target < next) {
+				double f = (target - center)/(next - center);
+				return centroids_[i].mean + f*(centroids_[i+1].mean - centroids_[i].mean);
+			}
+			center = next;
+		}
+		return last.mean;
+	}
+
+	/**
+	 * @brief Bin edges that split the weight into nbins parts of equal
+	 *        population
+	 *
+	 * The first edge is the smallest value and the last lies just above
+	 * the largest, so that every value added falls into one of the bins.
+	 * Edges that coincide, e.g. for discrete data, are merged, so fewer
+	 * than nbins bins may result.
+	 */
+	std::vector<double> edges(size_t nbins) const
+	{
+		if (nbins == 0)
+			throw std::invalid_argument("Need at least one bin");
+		std::vector<double> edges;
+		edges.reserve(nbins+1);
+		edges.push_back(min_);
+		for (size_t i=1; i < nbins; i++) {
+			double edge = quantile(double(i)/nbins);
+			if (edge > edges.back())
+				edges.push_back(edge);
+		}
+		double upper = std::nextafter(max_, std::numeric_limits<double>::infinity());
+		if (upper > edges.back())
+			edges.push_back(upper);
+		return edges;
+	}
+
+	/** @brief A general axis with equal-population bins; see edges() */
+	binning::general binning(size_t nbins, const std::string &name=std::string()) const
+	{
+		return binning::general(edges(nbins), name);
+	}
+
+private:
+	struct centroid {
+		double mean, weight;
+		bool operator<(const centroid &other) const { return mean < other.mean; }
+	};
+
+	size_t buffer_size() const { return size_t(5*compression_); }
+
+	static constexpr double pi = 3.14159265358979323846;
+
+	// Arcsine scale function and its inverse
+	double k(double q) const { return compression_/(2*pi)*std::asin(2*q-1); }
+	double q(double k) const { return (std::sin(2*pi*k/compression_)+1)/2; }
+
+	// Largest cumulative fraction a centroid starting at q0 may reach. k
+	// is at most compression/4 (at q=1); past that q() would wrap back
+	// down and turn every remaining centroid into a singleton.
+	double limit(double q0) const
+	{
+		double next = k(q0) + 1;
+		return next >= compression_/4 ? 1. : q(next);
+	}
+
+	// Fold buffered values into the centroids. Const because the summary
+	// of the values added does not change, but not safe to call from
+	// several threads at once.
+	// At most compression+1 centroids remain: any two neighbouring
+	// centroids span more than 1 in k, and k spans compression/2 in total.
+	void compress() const
+	{
+		if (buffer_.empty())
+			return;
+		buffer_.insert(buffer_.end(), centroids_.begin(), centroids_.end());
+		std::sort(buffer_.begin(), buffer_.end());
+		total_ += unmerged_;
+		unmerged_ = 0;
+
+		centroids_.clear();
+		centroid current = buffer_.front();
+		double q0 = 0, upper = limit(q0);
+		for (size_t i=1; i < buffer_.size(); i++) {
+			const centroid &next = buffer_[i];
+			if (q0 + (current.weight + next.weight)/total_ <= upper) {
+				current.weight += next.weight;
+				current.mean += (next.mean - current.mean)*next.weight/current.weight;
+			} else {
+				centroids_.push_back(current);
+				q0 += current.weight/total_;
+				upper = limit(q0);
+				current = next;
+			}
+		}
+		centroids_.push_back(current);
+		buffer_.clear();
+	}
+
+	double compression_;
+	mutable std::vector<centroid> centroids_, buffer_;
+	mutable double total_, unmerged_;
+	double min_, max_;
+};
+
+}
+
+#endif // HISTOGRAM_SKETCH_H_INCLUDED
@@ -3,8 +3,12 @@
 #define HISTOGRAM_HISTSTORAGE_H_INCLUDED
 
 #include "simple_hdf5.hpp"
+#ifdef HISTOGRAM_PERF_COUNTERS
+#include "histogram_perf.h"
+#endif
 #include <sstream>
 #include <algorithm>
+#include <stdexcept>
 
 namespace histogram {
 
@@ -26,7 +30,120 @@ get_shape(const view<T,N> &d)
 
 template <typename T, size_t N>
 hdf5::Datatype
-get_datatype(const view<T,N> &d) { return hdf5::get_datatype(T()); }
+get_datatype(const view<T,N> &) { return hdf5::get_datatype(T()); }
+
+// Whether the elements of a view can be selected with a hyperslab of a
+// row-major memory space: strides must be nonzero and decrease, each a
+// multiple of the next, with room for the extent of the inner axes in
+// between
+template <typename T, size_t N>
+bool
+is_hyperslab(const view<T,N> &d)
+{
+	if (d.strides_[N-1] == 0)
+		return false;
+	for (size_t i=1; i < N; i++) {
+		if (d.strides_[i] == 0 || d.strides_[i-1] % d.strides_[i] != 0)
+			return false;
+		if (d.strides_[i-1] < (i+1 < N ? d.strides_[i]*d.shape_[i] : (d.shape_[i]-1)*d.strides_[i]+1))
+			return false;
+	}
+	return true;
+}
+
+// Describe a strided view as a hyperslab of a memory space whose
+// row-major strides are those of the view, so that HDF5 gathers the
+// elements itself instead of writing from a copy
+template <typename T, size_t N>
+hdf5::Dataspace
+get_memory_space(const view<T,N> &d)
+{
+	if (d.is_contiguous() || d.size() == 0)
+		return hdf5::Dataspace(get_shape(d));
+	if (!is_hyperslab(d))
+		throw std::logic_error("View cannot be written without a copy");
+	std::vector<hsize_t> dims(N), start(N, 0), stride(N, 1), count(get_shape(d));
+	dims[0] = d.shape_[0];
+	for (size_t i=1; i < N; i++)
+		dims[i] = d.strides_[i-1]/d.strides_[i];
+	dims[N-1] = (N > 1) ? d.strides_[N-2] : (d.shape_[0]-1)*d.strides_[0]+1;
+	stride[N-1] = d.strides_[N-1];
+	hdf5::Dataspace space(std::move(dims));
+	if (H5Sselect_hyperslab(space, H5S_SELECT_SET, start.data(), stride.data(), count.data(), NULL) < 0)
+		throw std::runtime_error("Couldn't select the elements of a strided view");
+	return space;
+}
+
+// The view itself if HDF5 can select its elements, otherwise a copy
+template <typename T, size_t N>
+view<T,N>
+writable(const view<T,N> &d)
+{ return (d.is_contiguous() || is_hyperslab(d)) ? d : d.contiguous(); }
+
+}
+
+// storage adapters for span
+template <typename T>
+const void*
+get_data(const span<T> &d) { return d.data(); }
+
+template <typename T>
+std::vector<hsize_t>
+get_shape(const span<T> &d) { return std::vector<hsize_t>{d.size()}; }
+
+template <typename T>
+hdf5::Datatype
+get_datatype(const span<T> &) { return hdf5::get_datatype(typename std::remove_const<T>::type()); }
+
+// Axis metadata, by reference where the histogram offers it
+namespace detail {
+
+template <typename T>
+auto axis_edges(const T &hist, int) -> decltype(hist.edges())
+{ return hist.edges(); }
+
+template <typename T>
+auto axis_edges(const T &hist, long) -> decltype(hist.binedges())
+{ return hist.binedges(); }
+
+template <typename T>
+auto axis_label(const T &hist, size_t i, int) -> decltype(hist.label(i))
+{ return hist.label(i); }
+
+template <typename T>
+std::string axis_label(const T &hist, size_t i, long)
+{ return hist.labels()[i]; }
+
+}
+
+// attributes for detail::fill_statistics
+namespace detail {
+
+template <size_t N>
+void save_statistics(const fill_statistics<N, true> &stats, hdf5::Node::AttributeSet &attr)
+{
+	attr["nrejected"] = stats.n_rejected();
+	attr["sumweights"] = stats.sum_weights();
+	for (size_t i=0; i < N; i++) {
+		std::ostringstream ss;
+		ss << "_" << i;
+		attr["underflow" + ss.str()] = stats.underflow()[i];
+		attr["overflow" + ss.str()] = stats.overflow()[i];
+	}
+}
+
+template <size_t N>
+void save_statistics(const fill_statistics<N, false> &, hdf5::Node::AttributeSet &)
+{}
+
+template <typename T>
+auto save_statistics(const T &hist, hdf5::Node::AttributeSet &attr, int)
+    -> decltype(hist.statistics(), void())
+{ save_statistics(hist.statistics(), attr); }
+
+template <typename T>
+void save_statistics(const T &, hdf5::Node::AttributeSet &, long)
+{}
 
 }
 
@@ -96,9 +213,13 @@ detail::enumerate_object<Iterable, false> enumerate(const Iterable&& iter)
 }
 
 template <typename T>
-void save(const T& hist, hdf5::File file, const std::string &where, const std::string &name, bool overwrite=false)
+void save(const T& hist, hdf5::File file, const std::string &where, const std::string &name, bool overwrite=false,
+    const hdf5::FilterOptions &filters=hdf5::FilterOptions())
 {
 	using namespace hdf5;
+#ifdef HISTOGRAM_PERF_COUNTERS
+	auto counters = perf::measure(hist, "save");
+#endif
 	
 	Group group = file.create_group(where, name, true);
 	auto attr = group.attrs();
@@ -106,25 +227,27 @@ void save(const T& hist, hdf5::File file, const std::string &where, const std::s
 	attr["ndim"] = hist.ndim();
 	attr["nentries"] = hist.n_entries();
 	attr["title"] = hist.title();
+	detail::save_statistics(hist, attr, 0);
 	
-	file.create_carray(group, "_h_bincontent", hist.bincontent());
-	file.create_carray(group, "_h_squaredweights", hist.squaredweights());
-	for (const auto &pair : enumerate(hist.binedges())) {
+	file.create_carray(group, "_h_bincontent", detail::writable(hist.bincontent()), false, filters);
+	file.create_carray(group, "_h_squaredweights", detail::writable(hist.squaredweights()), false, filters);
+	for (const auto &pair : enumerate(detail::axis_edges(hist, 0))) {
 		std::ostringstream ss;
 		ss << "_h_binedges_" << pair.first;
-		file.create_carray(group, ss.str(), pair.second);
+		file.create_carray(group, ss.str(), pair.second, false, filters);
 	}
-	for (const auto &pair : enumerate(hist.labels())) {
+	for (size_t i=0; i < hist.ndim(); i++) {
 		std::ostringstream ss;
-		ss << "label_" << pair.first;
-		attr[ss.str()] = pair.second;
+		ss << "label_" << i;
+		attr[ss.str()] = detail::axis_label(hist, i, 0);
 	}
 }
 
 template <typename T>
-void save(const T& hist, const std::string &fname, const std::string &where, const std::string &name, bool overwrite=false)
+void save(const T& hist, const std::string &fname, const std::string &where, const std::string &name, bool overwrite=false,
+    const hdf5::FilterOptions &filters=hdf5::FilterOptions())
 {
-	save(hist, hdf5::open_file(fname, hdf5::File::append), where, name, overwrite);
+	save(hist, hdf5::open_file(fname, hdf5::File::append), where, name, overwrite, filters);
 }
 
 }
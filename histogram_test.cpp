@@ -0,0 +1,493 @@
+#include "histogram.h"
+#include "histogram_storage.h"
+#include "histogram_wire.h"
+#include "histogram_aggregator.h"
+#include "histogram_decay.h"
+#include "histogram_sketch.h"
+
+#include <cmath>
+#include <cstddef>
+#include <cstdio>
+#include <cstring>
+#include <limits>
+#include <random>
+
+// Behaviour tests, run with `make check`. Each test_ function checks one
+// component and reports failed checks with their line; the exit status is
+// nonzero if any check failed.
+
+namespace {
+
+using namespace histogram::binning;
+
+int failures = 0;
+
+void check(bool ok, const char *what, int line)
+{
+	if (!ok) {
+		std::fprintf(stderr, "histogram_test.cpp:%d: check failed: %s\n", line, what);
+		failures++;
+	}
+}
+
+#define CHECK(cond) check((cond), #cond, __LINE__)
+
+template <typename Exception, typename Function>
+bool throws(Function &&f)
+{
+	try {
+		f();
+	} catch (const Exception &) {
+		return true;
+	}
+	return false;
+}
+
+template <typename H1, typename H2>
+bool same_bins(const H1 &a, const H2 &b)
+{
+	auto ca = a.bincontent(), cb = b.bincontent();
+	auto sa = a.squaredweights(), sb = b.squaredweights();
+	if (ca.shape_ != cb.shape_)
+		return false;
+	for (size_t i=0; i < ca.size(); i++)
+		if (ca.data_[i] != cb.data_[i] || sa.data_[i] != sb.data_[i])
+			return false;
+	return true;
+}
+
+// Values that stress the index kernels: random ones across and beyond
+// the axis, every edge and its neighbours, and the special values
+std::vector<double> probe_values(const linear &axis, std::mt19937 &rng)
+{
+	const double inf = std::numeric_limits<double>::infinity();
+	std::vector<double> values = {
+	    std::numeric_limits<double>::quiet_NaN(), inf, -inf, 0., -0.,
+	    std::numeric_limits<double>::max(), -std::numeric_limits<double>::max(),
+	    std::numeric_limits<double>::denorm_min()
+	};
+	for (double edge : axis.edges()) {
+		values.push_back(edge);
+		values.push_back(std::nextafter(edge, inf));
+		values.push_back(std::nextafter(edge, -inf));
+	}
+	const double width = axis.high() - axis.low();
+	std::uniform_real_distribution<double> uniform(axis.low() - width/4, axis.high() + width/4);
+	for (size_t i=0; i < 10000; i++)
+		values.push_back(uniform(rng));
+	return values;
+}
+
+// user-058, user-059: the batch index kernels agree with index(double)
+void test_index_kernels()
+{
+	std::mt19937 rng(58);
+	const linear axes[] = { linear(-5, 5, 100), linear(0, 1, 3), linear(-1e6, 1e6, 1000),
+	    linear(0.1, 0.7, 37) };
+	for (const linear &axis : axes) {
+		std::vector<double> values = probe_values(axis, rng);
+		std::vector<size_t> bins(values.size());
+		axis.index(values.size(), values.data(), bins.data());
+		size_t mismatches = 0;
+		for (size_t i=0; i < values.size(); i++)
+			mismatches += bins[i] != (std::isnan(values[i]) ? 0 : axis.index(values[i]));
+		CHECK(mismatches == 0);
+
+		std::vector<float> floats(values.begin(), values.end());
+		for (double edge : axis.edges()) {
+			float f = float(edge);
+			floats.push_back(f);
+			floats.push_back(std::nextafter(f, std::numeric_limits<float>::infinity()));
+			floats.push_back(std::nextafter(f, -std::numeric_limits<float>::infinity()));
+		}
+		bins.resize(floats.size());
+		axis.index(floats.size(), floats.data(), bins.data());
+		mismatches = 0;
+		for (size_t i=0; i < floats.size(); i++)
+			mismatches += bins[i] != (std::isnan(floats[i]) ? 0 : axis.index(double(floats[i])));
+		CHECK(mismatches == 0);
+	}
+
+	// Integer weights, so that the sums are exact in any order
+	auto batch = histogram::create(linear(-3, 3, 40), linear(-3, 3, 30));
+	auto single = batch.clone_empty();
+	std::normal_distribution<double> gauss;
+	std::vector<double> x(5000), y(5000), w(5000);
+	for (size_t i=0; i < x.size(); i++) {
+		x[i] = gauss(rng);
+		y[i] = i % 97 == 0 ? std::numeric_limits<double>::quiet_NaN() : gauss(rng);
+		w[i] = 1 + i % 3;
+	}
+	size_t accepted = batch.fill_batch(x.size(), w.data(), x.data(), y.data());
+	size_t expected = 0;
+	for (size_t i=0; i < x.size(); i++)
+		expected += single.fill_with_weight(w[i], x[i], y[i]);
+	CHECK(accepted == expected);
+	CHECK(batch.n_entries() == single.n_entries());
+	CHECK(same_bins(batch, single));
+}
+
+// user-062: serialized histograms read back intact, and damage is caught
+void test_wire()
+{
+	auto hist = histogram::create("wire", linear(0, 10, 20, "x"), histogram::binning::log10(1, 1e3, 6, "y"));
+	std::mt19937 rng(62);
+	std::uniform_real_distribution<double> uniform(-1, 11);
+	for (size_t i=0; i < 10000; i++)
+		hist.fill_with_weight(0.5, uniform(rng), std::pow(10., uniform(rng)/3));
+	typedef decltype(hist) histogram_type;
+
+	std::vector<char> buffer = histogram::wire::serialize(hist, 16);
+	histogram::wire::reader reader(buffer.data(), buffer.size());
+	CHECK(reader.title() == "wire");
+	CHECK(reader.n_blocks() > 1);
+	CHECK(reader.verify());
+	CHECK(throws<std::out_of_range>([&] { reader.verify_block(reader.n_blocks()); }));
+	histogram_type copy = histogram::wire::deserialize<histogram_type>(buffer.data(), buffer.size());
+	CHECK(copy.title() == hist.title());
+	CHECK(copy.n_entries() == hist.n_entries());
+	CHECK(copy.binedges() == hist.binedges());
+	CHECK(same_bins(copy, hist));
+
+	typedef histogram::wire::file_header header;
+	CHECK(throws<std::runtime_error>([&] {
+		histogram::wire::reader(buffer.data(), buffer.size()-1);
+	}));
+	CHECK(throws<std::runtime_error>([&] {
+		histogram::wire::reader(buffer.data(), sizeof(header)-1);
+	}));
+	{
+		std::vector<char> bad = buffer;
+		bad[0] ^= 1;
+		CHECK(throws<std::runtime_error>([&] { histogram::wire::reader(bad.data(), bad.size()); }));
+	}
+	{
+		// Metadata that is not a whole number of checksummed words
+		std::vector<char> bad = buffer;
+		uint64_t meta_size;
+		std::memcpy(&meta_size, bad.data() + offsetof(header, meta_size), sizeof(meta_size));
+		meta_size--;
+		std::memcpy(bad.data() + offsetof(header, meta_size), &meta_size, sizeof(meta_size));
+		CHECK(throws<std::runtime_error>([&] { histogram::wire::reader(bad.data(), bad.size()); }));
+	}
+	{
+		// A corrupt size must not be trusted
+		std::vector<char> bad = buffer;
+		uint64_t nbins = ~uint64_t(0)/8;
+		std::memcpy(bad.data() + offsetof(header, nbins), &nbins, sizeof(nbins));
+		CHECK(throws<std::runtime_error>([&] { histogram::wire::reader(bad.data(), bad.size()); }));
+	}
+	{
+		// A flipped bit in the bins fails its block checksum
+		std::vector<char> bad = buffer;
+		const char *content = reinterpret_cast<const char*>(reader.bincontent());
+		bad[(content - buffer.data()) + 3*sizeof(double)] ^= 4;
+		histogram::wire::reader damaged(bad.data(), bad.size());
+		CHECK(!damaged.verify_block(0));
+		CHECK(damaged.verify_block(1));
+		CHECK(throws<std::runtime_error>([&] {
+			histogram::wire::deserialize<histogram_type>(bad.data(), bad.size());
+		}));
+	}
+}
+
+struct tracked_traits : histogram::default_traits {
+	typedef histogram::tracking::cache_lines tracking_type;
+};
+
+// user-063: deltas keep a replica in sync, and malformed ones are refused
+void test_delta()
+{
+	typedef histogram::basic_histogram<tracked_traits, linear> tracked;
+	tracked source(linear(0, 1, 1000)), replica(linear(0, 1, 1000));
+	std::mt19937 rng(63);
+	std::uniform_real_distribution<double> uniform(-0.1, 1.1);
+	for (size_t i=0; i < 2000; i++)
+		source.fill(uniform(rng));
+	replica.apply_delta(source.extract_delta());
+	CHECK(same_bins(replica, source));
+	CHECK(replica.n_entries() == source.n_entries());
+
+	// Only the blocks written since the last extraction are sent
+	source.fill(0.5);
+	histogram::bin_delta delta = source.extract_delta();
+	CHECK(delta.blocks.size() == 1);
+	replica.apply_delta(delta);
+	CHECK(same_bins(replica, source));
+	CHECK(source.extract_delta().blocks.empty());
+
+	tracked before(replica);
+	histogram::bin_delta bad = delta;
+	bad.blocks.push_back((bad.size + bad.block_size - 1)/bad.block_size);
+	bad.bincontent.resize(bad.bincontent.size() + bad.block_size);
+	bad.squaredweights.resize(bad.squaredweights.size() + bad.block_size);
+	CHECK(throws<std::invalid_argument>([&] { replica.apply_delta(bad); }));
+	bad = delta;
+	bad.bincontent.pop_back();
+	CHECK(throws<std::invalid_argument>([&] { replica.apply_delta(bad); }));
+	bad = delta;
+	bad.size++;
+	CHECK(throws<std::invalid_argument>([&] { replica.apply_delta(bad); }));
+	bad = delta;
+	bad.block_size = 0;
+	CHECK(throws<std::invalid_argument>([&] { replica.apply_delta(bad); }));
+	CHECK(same_bins(replica, before));
+}
+
+// Write raw bytes to the aggregator, as a misbehaving worker would
+int connect_raw(const std::string &path)
+{
+	sockaddr_un addr;
+	histogram::detail::make_unix_address(path, addr);
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd >= 0 && connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0) {
+		close(fd);
+		fd = -1;
+	}
+	return fd;
+}
+
+bool send_raw(int fd, const void *data, size_t size)
+{
+	return ::send(fd, data, size, MSG_NOSIGNAL) == ssize_t(size);
+}
+
+template <typename Condition>
+void poll_until(histogram::aggregator &agg, Condition &&done)
+{
+	for (int i=0; i < 100 && !done(); i++)
+		agg.poll(10);
+}
+
+// user-061: the aggregator merges whole deltas, however they arrive, and
+// drops workers that announce more than any booked histogram holds
+void test_aggregator_framing()
+{
+	const std::string path = "/tmp/histogram_test_" + std::to_string(getpid()) + ".sock";
+	histogram::aggregator agg(path);
+	auto &master = agg.book("h", linear(0, 1, 10));
+	agg.book("big", linear(0, 1, 1000));
+	CHECK(throws<std::invalid_argument>([&] { agg.book("h", linear(0, 1, 3)); }));
+
+	auto worker = histogram::create(linear(0, 1, 10));
+	auto expected = worker.clone_empty();
+	{
+		histogram::aggregator_client client(path);
+		for (int i=0; i < 3; i++) {
+			worker.fill_with_weight(2., 0.05 + 0.3*i);
+			expected.fill_with_weight(2., 0.05 + 0.3*i);
+			client.send("h", worker);
+			CHECK(worker.n_entries() == 0);
+		}
+		poll_until(agg, [&] { return agg.n_merged() == 3; });
+	}
+	CHECK(agg.n_merged() == 3);
+	CHECK(master.n_entries() == 3);
+	CHECK(same_bins(master, expected));
+
+	// A delta split across reads is buffered until it is complete
+	std::vector<double> dense(2*master.bincontent().size(), 0.);
+	dense[2] = 1;
+	dense[2 + dense.size()/2] = 1;
+	histogram::detail::delta_header header;
+	header.magic = histogram::detail::delta_header::expected_magic;
+	header.name_size = 1;
+	header.fingerprint = histogram::binning_fingerprint(master);
+	header.n_entries = 1;
+	header.nbins = dense.size()/2;
+	header.nsparse = histogram::detail::delta_header::dense;
+	int fd = connect_raw(path);
+	CHECK(fd >= 0);
+	CHECK(send_raw(fd, &header, sizeof(header) - 8));
+	poll_until(agg, [&] { return agg.n_connections() == 1; });
+	agg.poll(10);
+	CHECK(send_raw(fd, reinterpret_cast<const char*>(&header) + sizeof(header) - 8, 8));
+	CHECK(send_raw(fd, "h", 1));
+	agg.poll(10);
+	CHECK(agg.n_merged() == 3);
+	CHECK(send_raw(fd, dense.data(), dense.size()*sizeof(double)));
+	poll_until(agg, [&] { return agg.n_merged() == 4; });
+	CHECK(agg.n_merged() == 4);
+	CHECK(master.bincontent().data_[2] == 1);
+	close(fd);
+
+	// More bins than the largest booked histogram: dropped before the
+	// payload is buffered, and the worker is disconnected
+	size_t dropped = agg.n_dropped();
+	header.nbins = uint64_t(1) << 40;
+	fd = connect_raw(path);
+	CHECK(send_raw(fd, &header, sizeof(header)));
+	CHECK(send_raw(fd, "h", 1));
+	poll_until(agg, [&] { return agg.n_dropped() > dropped; });
+	CHECK(agg.n_dropped() == dropped + 1);
+	poll_until(agg, [&] { return agg.n_connections() == 0; });
+	CHECK(agg.n_connections() == 0);
+	close(fd);
+
+	// More bins than the named histogram, though fewer than another
+	header.nbins = 500;
+	fd = connect_raw(path);
+	CHECK(send_raw(fd, &header, sizeof(header)));
+	CHECK(send_raw(fd, "h", 1));
+	poll_until(agg, [&] { return agg.n_dropped() > dropped + 1; });
+	CHECK(agg.n_dropped() == dropped + 2);
+	close(fd);
+
+	// Releasing the largest histogram lowers the bound
+	agg.release("big");
+	header.nbins = 100;
+	fd = connect_raw(path);
+	CHECK(send_raw(fd, &header, sizeof(header)));
+	CHECK(send_raw(fd, "h", 1));
+	poll_until(agg, [&] { return agg.n_dropped() > dropped + 2; });
+	CHECK(agg.n_dropped() == dropped + 3);
+	close(fd);
+	CHECK(agg.n_merged() == 4);
+}
+
+// user-066: contents halve every half-life, also across a rescale
+void test_decay()
+{
+	typedef histogram::decaying_histogram<linear> decaying;
+	const std::chrono::hours half_life(1);
+	decaying hist(half_life, linear(0, 1, 4));
+	const decaying::clock_type::time_point start = decaying::clock_type::now();
+	hist.fill_with_weight(2., 0.1);
+
+	auto content = [&](size_t bin) { return hist.bincontent().data_[bin]; };
+	auto sumw2 = [&](size_t bin) { return hist.squaredweights().data_[bin]; };
+	auto close_to = [](double a, double b) { return std::abs(a - b) <= 1e-6*std::abs(b); };
+	CHECK(content(1) == 2.);
+	hist.advance(start + half_life);
+	CHECK(close_to(content(1), 1.));
+	CHECK(close_to(sumw2(1), 1.));
+	// Entries filled now count in full
+	hist.fill(0.9);
+	CHECK(close_to(content(4), 1.));
+	hist.advance(start + 3*half_life);
+	CHECK(close_to(content(1), 0.25));
+	CHECK(close_to(content(4), 0.25));
+	CHECK(close_to(hist.value().bincontent().data_[4], 0.25));
+	// Going back in time does nothing
+	hist.advance(start);
+	CHECK(close_to(content(4), 0.25));
+
+	// Past 256 half-lives the bins are rescaled and the scale reset
+	hist.advance(start + 300*half_life);
+	CHECK(hist.scale() == 1.);
+	CHECK(close_to(content(1), std::ldexp(2., -300)));
+	hist.fill(0.9);
+	CHECK(close_to(content(4), 1.));
+	hist.advance(start + 301*half_life);
+	CHECK(close_to(content(4), 0.5));
+	CHECK(close_to(sumw2(4), 0.25));
+	CHECK(hist.n_entries() == 3);
+}
+
+// user-068: quantiles are accurate and the centroids stay bounded
+void test_sketch()
+{
+	CHECK(throws<std::invalid_argument>([] { histogram::quantile_sketch(5); }));
+	CHECK(throws<std::logic_error>([] { histogram::quantile_sketch().quantile(0.5); }));
+
+	const double compression = 100;
+	std::vector<histogram::quantile_sketch> shards(4, histogram::quantile_sketch(compression));
+	std::mt19937 rng(68);
+	std::uniform_real_distribution<double> uniform;
+	for (size_t i=0; i < 400000; i++) {
+		shards[i % shards.size()].fill(uniform(rng));
+		if (i % 10007 == 0)
+			CHECK(shards[i % shards.size()].size() <= compression + 1);
+	}
+	histogram::quantile_sketch merged(compression);
+	for (const histogram::quantile_sketch &shard : shards) {
+		merged += shard;
+		CHECK(merged.size() <= compression + 1);
+	}
+	CHECK(merged.total_weight() == 400000);
+	CHECK(merged.quantile(0) == merged.min());
+	CHECK(merged.quantile(1) == merged.max());
+	// Centroids in the middle hold up to about pi/compression of the
+	// weight, and the interpolation is much better than that
+	double worst = 0, tails = 0;
+	for (double q : {0.1, 0.25, 0.5, 0.75, 0.9})
+		worst = std::max(worst, std::abs(merged.quantile(q) - q));
+	for (double q : {0.001, 0.01, 0.99, 0.999})
+		tails = std::max(tails, std::abs(merged.quantile(q) - q));
+	CHECK(worst < 1/compression);
+	CHECK(tails < 1e-3);
+
+	// Equal-population edges cover every value
+	std::vector<double> edges = merged.edges(10);
+	CHECK(edges.size() == 11);
+	CHECK(edges.front() == merged.min());
+	CHECK(edges.back() > merged.max());
+}
+
+template <size_t N>
+bool written_intact(hdf5::File &file, const std::string &name, const histogram::detail::view<double,N> &v)
+{
+	hdf5::Dataset dataset = file.create_carray("/", name, histogram::detail::writable(v));
+	std::vector<hsize_t> shape = dataset.shape();
+	std::vector<double> data;
+	dataset.read(data);
+	histogram::detail::view<double,N> expected = v.contiguous();
+	if (shape.size() != N || data.size() != v.size())
+		return false;
+	for (size_t i=0; i < N; i++)
+		if (shape[i] != v.shape_[i])
+			return false;
+	return std::equal(data.begin(), data.end(), expected.data_);
+}
+
+// user-071: slices and transpositions are written with their own shape
+// and elements, whether HDF5 gathers them or they are copied first
+void test_views()
+{
+	histogram::histogram<linear, linear, linear> hist(linear(0, 1, 6), linear(0, 1, 4), linear(0, 1, 5));
+	std::mt19937 rng(71);
+	std::uniform_real_distribution<double> uniform(-0.2, 1.2);
+	for (size_t i=0; i < 20000; i++)
+		hist.fill(uniform(rng), uniform(rng), uniform(rng));
+	auto v = hist.bincontent();
+	CHECK(v(2, 3, 4) == v.data_[(2*6 + 3)*7 + 4]);
+	CHECK(v.transpose()(4, 3, 2) == v(2, 3, 4));
+	CHECK(v.slice(1, 2, 4)(2, 1, 4) == v(2, 3, 4));
+
+	hdf5::File file = hdf5::open_memory_file("histogram_test.h5", hdf5::File::write, false);
+	CHECK(written_intact(file, "whole", v));
+	CHECK(written_intact(file, "slice0", v.slice(0, 1, 5)));
+	CHECK(written_intact(file, "slice1", v.slice(1, 2, 4)));
+	CHECK(written_intact(file, "slice2", v.slice(2, 1, 6).slice(0, 2, 3)));
+	CHECK(written_intact(file, "transpose", v.transpose()));
+	CHECK(written_intact(file, "swap", v.transpose(0, 1).slice(2, 1, 3)));
+	histogram::detail::view<double,1> strided(v.data_ + 3, {{8}}, {{7}});
+	CHECK(histogram::detail::is_hyperslab(strided));
+	CHECK(written_intact(file, "strided", strided));
+	// Repeated elements cannot be described as a hyperslab
+	histogram::detail::view<double,1> broadcast(v.data_ + 5, {{4}}, {{0}});
+	CHECK(!histogram::detail::is_hyperslab(broadcast));
+	CHECK(written_intact(file, "broadcast", broadcast));
+	histogram::detail::view<double,2> repeated(v.data_, {{3, 4}}, {{1, 0}});
+	CHECK(!histogram::detail::is_hyperslab(repeated));
+	CHECK(written_intact(file, "repeated", repeated));
+	CHECK(throws<std::out_of_range>([&] { v.slice(1, 2, 9); }));
+}
+
+}
+
+int main()
+{
+	test_index_kernels();
+	test_wire();
+	test_delta();
+	test_aggregator_framing();
+	test_decay();
+	test_sketch();
+	test_views();
+	if (failures)
+		std::fprintf(stderr, "%d checks failed\n", failures);
+	else
+		std::printf("All checks passed\n");
+	return failures != 0;
+}
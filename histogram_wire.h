@@ -0,0 +1,478 @@
+
+#ifndef HISTOGRAM_WIRE_H_INCLUDED
+#define HISTOGRAM_WIRE_H_INCLUDED
+
+#include "histogram.h"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+
+namespace histogram {
+
+/**
+ * @brief A flat binary format for shipping and caching histograms
+ *
+ * A serialized histogram consists of
+ *  - a 64-byte header (see file_header),
+ *  - metadata: the title and, for each axis, its type name, label,
+ *    constructor parameters and bin edges,
+ *  - the bin contents and squared weights as row-major arrays of
+ *    little-endian doubles, starting on a 64-byte boundary,
+ *  - optionally, one checksum per block of bins for each array.
+ *
+ * A reader interprets a buffer (e.g. a mapped file) in place: the bin
+ * arrays are never copied. Only little-endian hosts are supported.
+ */
+namespace wire {
+
+static_assert(__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__, "The wire format is little-endian");
+
+/** @brief FNV-1a over 64-bit words */
+inline uint64_t checksum(const void *data, size_t nwords)
+{
+	const char *bytes = static_cast<const char*>(data);
+	uint64_t hash = 0xcbf29ce484222325ull;
+	for (size_t i=0; i < nwords; i++) {
+		uint64_t word;
+		std::memcpy(&word, bytes + i*sizeof(word), sizeof(word));
+		hash = (hash ^ word)*0x100000001b3ull;
+	}
+	return hash;
+}
+
+struct file_header {
+	static constexpr char expected_magic[8] = {'D','H','I','S','T','W','I','R'};
+	static constexpr uint32_t current_version = 1;
+
+	char magic[8];
+	uint32_t version;
+	uint32_t ndim;
+	uint64_t n_entries;
+	/** Total number of bins, including under- and overflow */
+	uint64_t nbins;
+	/** Bins per checksum block, or 0 if there are no checksums */
+	uint64_t block_size;
+	/** Size of the metadata in bytes, a multiple of 8 so that all of it is checksummed */
+	uint64_t meta_size;
+	uint64_t meta_checksum;
+	/** Offset of the bin contents from the start of the buffer */
+	uint64_t data_offset;
+
+	size_t n_blocks() const { return block_size ? nbins/block_size + (nbins % block_size != 0) : 0; }
+	size_t total_size() const
+	{ return data_offset + 2*nbins*sizeof(double) + 2*n_blocks()*sizeof(uint64_t); }
+};
+static_assert(sizeof(file_header) == 64, "Header must be 64 bytes");
+
+constexpr char file_header::expected_magic[8];
+constexpr uint32_t file_header::current_version;
+
+/** @brief Description of one axis in a serialized histogram */
+struct axis_record {
+	/** binning::type_name of the axis */
+	std::string type;
+	std::string name;
+	/** Arguments needed to reconstruct the axis besides its name */
+	std::vector<double> parameters;
+	std::vector<double> edges;
+};
+
+/**
+ * @brief Conversion between a binning scheme and its axis_record
+ *
+ * Specialize this to make a new binning scheme serializable.
+ */
+template <typename T>
+struct axis_codec;
+
+/** @cond */
+template <>
+struct axis_codec<binning::general> {
+	static std::vector<double> parameters(const binning::general &) { return {}; }
+	static binning::general make(const axis_record &r) { return binning::general(r.edges, r.name); }
+};
+
+template <typename Transformation>
+struct axis_codec<binning::uniform<Transformation> > {
+	static std::vector<double> parameters(const binning::uniform<Transformation> &axis)
+	{ return { axis.low(), axis.high(), double(axis.nbins()-2) }; }
+	static binning::uniform<Transformation> make(const axis_record &r)
+	{
+		if (r.parameters.size() != 3)
+			throw std::runtime_error("Malformed parameters for axis " + r.name);
+		return binning::uniform<Transformation>(r.parameters[0], r.parameters[1],
+		    size_t(r.parameters[2]), r.name);
+	}
+};
+template <>
+struct axis_codec<binning::log_linear> {
+	static std::vector<double> parameters(const binning::log_linear &axis)
+	{ return { axis.low(), axis.high(), double(axis.bits()) }; }
+	static binning::log_linear make(const axis_record &r)
+	{
+		if (r.parameters.size() != 3)
+			throw std::runtime_error("Malformed parameters for axis " + r.name);
+		return binning::log_linear(r.parameters[0], r.parameters[1], unsigned(r.parameters[2]), r.name);
+	}
+};
+/** @endcond */
+
+namespace detail {
+
+class writer {
+public:
+	void put(const void *data, size_t size)
+	{
+		const char *bytes = static_cast<const char*>(data);
+		buffer_.insert(buffer_.end(), bytes, bytes+size);
+	}
+	void put(uint64_t value) { put(&value, sizeof(value)); }
+	void put(const std::string &s)
+	{
+		uint32_t size = s.size();
+		put(&size, sizeof(size));
+		put(s.data(), s.size());
+	}
+	void put(const std::vector<double> &v)
+	{
+		put(uint64_t(v.size()));
+		put(v.data(), v.size()*sizeof(double));
+	}
+	/** Pad with zeros to a multiple of 8 bytes */
+	void align()
+	{
+		buffer_.resize((buffer_.size() + 7) & ~size_t(7), 0);
+	}
+	std::vector<char>& buffer() { return buffer_; }
+private:
+	std::vector<char> buffer_;
+};
+
+class parser {
+public:
+	parser(const char *begin, const char *end) : pos_(begin), end_(end) {}
+	void get(void *data, size_t size)
+	{
+		if (size_t(end_ - pos_) < size)
+			throw std::runtime_error("Truncated histogram metadata");
+		std::memcpy(data, pos_, size);
+		pos_ += size;
+	}
+	uint64_t get_u64() { uint64_t v; get(&v, sizeof(v)); return v; }
+	std::string get_string()
+	{
+		uint32_t size;
+		get(&size, sizeof(size));
+		if (size_t(end_ - pos_) < size)
+			throw std::runtime_error("Truncated histogram metadata");
+		std::string s(pos_, size);
+		pos_ += size;
+		return s;
+	}
+	std::vector<double> get_doubles()
+	{
+		uint64_t size = get_u64();
+		if (size_t(end_ - pos_)/sizeof(double) < size)
+			throw std::runtime_error("Truncated histogram metadata");
+		std::vector<double> v(size);
+		get(v.data(), size*sizeof(double));
+		return v;
+	}
+private:
+	const char *pos_, *end_;
+};
+
+struct axis_writer {
+	template <typename Axis>
+	void operator()(size_t, const Axis &axis)
+	{
+		out.put(binning::type_name<Axis>::value());
+		out.put(axis.name());
+		out.put(axis_codec<Axis>::parameters(axis));
+		out.put(axis.edges());
+	}
+	writer &out;
+};
+
+}
+
+/**
+ * @brief Serialize a histogram
+ *
+ * @param[in] block_size number of bins per checksum block, or 0 to omit
+ *                       checksums
+ */
+template <class Traits, class... Ts>
+std::vector<char> serialize(const basic_histogram<Traits, Ts...> &hist, size_t block_size=0)
+{
+	detail::writer meta;
+	meta.put(hist.title());
+	detail::axis_writer axes = { meta };
+	hist.for_each_axis(axes);
+	meta.align();
+
+	file_header header;
+	std::memcpy(header.magic, file_header::expected_magic, sizeof(header.magic));
+	header.version = file_header::current_version;
+	header.ndim = sizeof...(Ts);
+	header.n_entries = hist.n_entries();
+	header.nbins = 1;
+	for (size_t n : hist.shape())
+		header.nbins *= n;
+	header.block_size = block_size;
+	header.meta_size = meta.buffer().size();
+	header.meta_checksum = checksum(meta.buffer().data(), meta.buffer().size()/sizeof(uint64_t));
+	header.data_offset = (sizeof(header) + header.meta_size + 63) & ~uint64_t(63);
+
+	std::vector<char> buffer(header.total_size(), 0);
+	std::memcpy(buffer.data(), &header, sizeof(header));
+	std::memcpy(buffer.data() + sizeof(header), meta.buffer().data(), header.meta_size);
+	char *content = buffer.data() + header.data_offset;
+	char *squares = content + header.nbins*sizeof(double);
+	std::memcpy(content, hist.bincontent().data_, header.nbins*sizeof(double));
+	std::memcpy(squares, hist.squaredweights().data_, header.nbins*sizeof(double));
+
+	char *sums = squares + header.nbins*sizeof(double);
+	for (size_t b=0; b < header.n_blocks(); b++) {
+		size_t first = b*block_size, count = std::min<size_t>(block_size, header.nbins-first);
+		uint64_t sum[2] = {
+			checksum(content + first*sizeof(double), count),
+			checksum(squares + first*sizeof(double), count)
+		};
+		std::memcpy(sums + b*sizeof(uint64_t), &sum[0], sizeof(uint64_t));
+		std::memcpy(sums + (header.n_blocks()+b)*sizeof(uint64_t), &sum[1], sizeof(uint64_t));
+	}
+	return buffer;
+}
+
+/**
+ * @brief A serialized histogram, read in place
+ *
+ * The header and metadata are parsed and checked on construction; the
+ * bin arrays are used directly from the buffer, which must stay alive and
+ * be 8-byte aligned.
+ */
+class reader {
+public:
+	/** @throws std::runtime_error if the buffer does not hold a valid histogram */
+	reader(const void *data, size_t size) : data_(static_cast<const char*>(data))
+	{
+		if (size < sizeof(header_))
+			throw std::runtime_error("Buffer too small for a histogram header");
+		std::memcpy(&header_, data_, sizeof(header_));
+		if (std::memcmp(header_.magic, file_header::expected_magic, sizeof(header_.magic)) != 0)
+			throw std::runtime_error("Buffer does not hold a serialized histogram");
+		if (header_.version != file_header::current_version)
+			throw std::runtime_error("Unsupported histogram format version");
+		// Sizes come from the buffer, so compare them against what is left
+		// of it rather than adding them up, which could overflow
+		size_t left = size - sizeof(header_);
+		if (header_.meta_size > left || header_.data_offset < sizeof(header_) + header_.meta_size
+		    || header_.data_offset > size)
+			throw std::runtime_error("Truncated serialized histogram");
+		left = size - header_.data_offset;
+		if (header_.nbins > left/(2*sizeof(double)))
+			throw std::runtime_error("Truncated serialized histogram");
+		left -= 2*header_.nbins*sizeof(double);
+		if (header_.n_blocks() > left/(2*sizeof(uint64_t)))
+			throw std::runtime_error("Truncated serialized histogram");
+		if (header_.ndim > header_.meta_size || header_.meta_size % sizeof(uint64_t) != 0)
+			throw std::runtime_error("Corrupt histogram metadata");
+		if (reinterpret_cast<uintptr_t>(data_) % alignof(double) != 0
+		    || header_.data_offset % alignof(double) != 0)
+			throw std::runtime_error("Serialized histogram must be 8-byte aligned");
+		const char *meta = data_ + sizeof(header_);
+		if (checksum(meta, header_.meta_size/sizeof(uint64_t)) != header_.meta_checksum)
+			throw std::runtime_error("Histogram metadata checksum mismatch");
+
+		detail::parser in(meta, meta + header_.meta_size);
+		title_ = in.get_string();
+		axes_.resize(header_.ndim);
+		size_t nbins = 1;
+		for (axis_record &axis : axes_) {
+			axis.type = in.get_string();
+			axis.name = in.get_string();
+			axis.parameters = in.get_doubles();
+			axis.edges = in.get_doubles();
+			if (axis.edges.size() < 2)
+				throw std::runtime_error("Axis " + axis.name + " has no bins");
+			nbins *= axis.edges.size()-1;
+		}
+		if (nbins != header_.nbins)
+			throw std::runtime_error("Axes do not match the number of bins");
+	}
+
+	size_t ndim() const { return header_.ndim; }
+	size_t n_entries() const { return header_.n_entries; }
+	const std::string& title() const { return title_; }
+	const std::vector<axis_record>& axes() const { return axes_; }
+
+	std::vector<size_t> shape() const
+	{
+		std::vector<size_t> shape;
+		for (const axis_record &axis : axes_)
+			shape.push_back(axis.edges.size()-1);
+		return shape;
+	}
+
+	/** Total number of bins */
+	size_t size() const { return header_.nbins; }
+	/** Bin contents in row-major order, pointing into the buffer */
+	const double* bincontent() const
+	{ return reinterpret_cast<const double*>(data_ + header_.data_offset); }
+	/** Sums of squared weights in row-major order, pointing into the buffer */
+	const double* squaredweights() const { return bincontent() + header_.nbins; }
+
+	/** Number of checksum blocks, or 0 if the buffer has no checksums */
+	size_t n_blocks() const { return header_.n_blocks(); }
+
+	/**
+	 * @brief Check the bins in block i of both arrays against their checksums
+	 *
+	 * @throws std::out_of_range if i >= n_blocks()
+	 */
+	bool verify_block(size_t i) const
+	{
+		if (i >= n_blocks())
+			throw std::out_of_range("Checksum block " + std::to_string(i) + " of " + std::to_string(n_blocks()));
+		const char *sums = reinterpret_cast<const char*>(squaredweights() + header_.nbins);
+		size_t first = i*header_.block_size, count = std::min<size_t>(header_.block_size, header_.nbins-first);
+		uint64_t expected[2];
+		std::memcpy(&expected[0], sums + i*sizeof(uint64_t), sizeof(uint64_t));
+		std::memcpy(&expected[1], sums + (n_blocks()+i)*sizeof(uint64_t), sizeof(uint64_t));
+		return checksum(bincontent()+first, count) == expected[0]
+		    && checksum(squaredweights()+first, count) == expected[1];
+	}
+
+	/** @brief Check all blocks. Trivially true if there are no checksums. */
+	bool verify() const
+	{
+		for (size_t i=0; i < n_blocks(); i++)
+			if (!verify_block(i))
+				return false;
+		return true;
+	}
+
+private:
+	const char *data_;
+	file_header header_;
+	std::string title_;
+	std::vector<axis_record> axes_;
+};
+
+namespace detail {
+
+template <typename Histogram>
+struct loader;
+
+template <class Traits, class... Ts>
+struct loader<basic_histogram<Traits, Ts...> > {
+	typedef basic_histogram<Traits, Ts...> histogram_type;
+
+	static histogram_type load(const reader &r)
+	{ return load(r, std::index_sequence_for<Ts...>()); }
+
+	template <size_t... I>
+	static histogram_type load(const reader &r, std::index_sequence<I...>)
+	{
+		if (r.ndim() != sizeof...(Ts))
+			throw std::runtime_error("Serialized histogram has a different number of dimensions");
+		std::array<std::string, sizeof...(Ts)> types = {{ binning::type_name<Ts>::value()... }};
+		for (size_t i=0; i < sizeof...(Ts); i++)
+			if (r.axes()[i].type != types[i])
+				throw std::runtime_error("Axis " + std::to_string(i) + " is "
+				    + r.axes()[i].type + ", not " + types[i]);
+		if (!r.verify())
+			throw std::runtime_error("Bin checksum mismatch");
+		histogram_type hist(axis_codec<Ts>::make(r.axes()[I])..., r.title());
+		if (hist.binedges() != edges(r, std::index_sequence<I...>()))
+			throw std::runtime_error("Reconstructed axes differ from the serialized bin edges");
+		hist.add(r.n_entries(), r.bincontent(), r.squaredweights());
+		return hist;
+	}
+
+	template <size_t... I>
+	static std::array<std::vector<double>, sizeof...(Ts)> edges(const reader &r, std::index_sequence<I...>)
+	{ return {{ r.axes()[I].edges... }}; }
+};
+
+}
+
+/**
+ * @brief Reconstruct a histogram of a known type from serialized form
+ *
+ * @throws std::runtime_error if the axis types differ or a checksum fails
+ */
+template <typename Histogram>
+Histogram deserialize(const reader &r)
+{
+	return detail::loader<Histogram>::load(r);
+}
+
+template <typename Histogram>
+Histogram deserialize(const void *data, size_t size)
+{
+	return deserialize<Histogram>(reader(data, size));
+}
+
+/** @brief Serialize a histogram into a file */
+template <class Traits, class... Ts>
+void write(const basic_histogram<Traits, Ts...> &hist, const std::string &fname, size_t block_size=0)
+{
+	std::vector<char> buffer = serialize(hist, block_size);
+	std::ofstream out(fname, std::ios::binary | std::ios::trunc);
+	out.write(buffer.data(), buffer.size());
+	if (!out)
+		throw std::runtime_error("Couldn't write " + fname);
+}
+
+/**
+ * @brief A read-only mapping of a serialized histogram file
+ */
+class mapped_file {
+public:
+	explicit mapped_file(const std::string &fname) : data_(NULL), size_(0)
+	{
+		int fd = open(fname.c_str(), O_RDONLY);
+		if (fd < 0)
+			throw std::runtime_error("Couldn't open " + fname);
+		struct stat st;
+		if (fstat(fd, &st) == 0 && st.st_size > 0) {
+			size_ = st.st_size;
+			data_ = mmap(NULL, size_, PROT_READ, MAP_SHARED, fd, 0);
+		}
+		close(fd);
+		if (data_ == NULL || data_ == MAP_FAILED) {
+			data_ = NULL;
+			throw std::runtime_error("Couldn't map " + fname);
+		}
+	}
+	mapped_file(const mapped_file&) = delete;
+	mapped_file& operator=(const mapped_file&) = delete;
+	~mapped_file() { munmap(data_, size_); }
+
+	const void* data() const { return data_; }
+	size_t size() const { return size_; }
+
+	/** A reader over the mapping, valid as long as this object */
+	wire::reader reader() const { return wire::reader(data_, size_); }
+
+private:
+	void *data_;
+	size_t size_;
+};
+
+}
+
+}
+
+#endif // HISTOGRAM_WIRE_H_INCLUDED
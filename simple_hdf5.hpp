@@ -10,6 +10,7 @@
 #include <H5Spublic.h>
 #include <H5Apublic.h>
 #include <H5Ppublic.h>
+#include <H5FDcore.h>
 
 #include <sstream>
 
@@ -192,6 +193,13 @@ get_shape(const std::vector<double> &v)
 { return std::vector<hsize_t> {v.size()}; }
 
 
+/// @brief Return a dataspace that selects the object's elements in memory
+/// Overload this for objects that are not contiguous, starting at get_data()
+template <typename T>
+Dataspace
+get_memory_space(const T &data)
+{ return Dataspace(get_shape(data)); }
+
 /// @brief Calculate an optimal chunk shape of the given size
 template <typename T>
 std::vector<hsize_t>
@@ -254,8 +262,8 @@ public:
 			Dataspace dspace(get_shape(value));
 			Datatype dtype(get_datatype(value));
 			
-			hid_t attr_id = H5Acreate2(node_, name_.c_str(), dtype, dspace, H5P_DEFAULT, H5P_DEFAULT);
-			H5Awrite(attr_id, dtype, get_data(value));
+			handle attr(H5Acreate2(node_, name_.c_str(), dtype, dspace, H5P_DEFAULT, H5P_DEFAULT), H5Aclose);
+			H5Awrite(attr, dtype, get_data(value));
 			
 			return value;
 		}
@@ -320,6 +328,32 @@ public:
 	void set_shuffle() { H5Pset_shuffle(*this); }
 };
 
+/// @brief Settings for opening files
+class FileAccessProperties : public PropertyList {
+public:
+	FileAccessProperties() : PropertyList(H5P_FILE_ACCESS) {}
+	/// @brief Keep the whole file in memory
+	/// @param[in] increment size in bytes by which to grow the buffer
+	/// @param[in] backing_store write the buffer to the named file when
+	///            the file is flushed or closed
+	void set_core(size_t increment, bool backing_store) { H5Pset_fapl_core(*this, increment, backing_store); }
+	/// @brief Open from a copy of the given file image instead of a file
+	void set_file_image(const void *data, size_t size) { H5Pset_file_image(*this, const_cast<void*>(data), size); }
+};
+
+/// @brief Chunking and compression settings for chunked arrays
+struct FilterOptions {
+	/// @param[in] max_chunk_size upper limit on the size of a chunk in bytes
+	/// @param[in] complevel deflate level (0 disables compression)
+	/// @param[in] shuffle apply the byte-shuffle filter before compression
+	FilterOptions(hsize_t max_chunk_size=size_t(2)<<15, unsigned int complevel=6, bool shuffle=true)
+	    : max_chunk_size(max_chunk_size), complevel(complevel), shuffle(shuffle)
+	{}
+	hsize_t max_chunk_size;
+	unsigned int complevel;
+	bool shuffle;
+};
+
 /// @brief A dataset
 class Dataset : public Node {
 public:
@@ -332,12 +366,38 @@ public:
 	{
 		// TODO: check return value
 	}
+	/// @brief Open an existing dataset
+	Dataset(Group group, const std::string &name) :
+	    Node(H5Dopen2(group, name.c_str(), H5P_DEFAULT), H5Dclose),
+	    parent_(group)
+	{}
+	/// @brief Get the dimensions of the dataset
+	std::vector<hsize_t> shape() const
+	{
+		handle space(H5Dget_space(*this), H5Sclose);
+		std::vector<hsize_t> dims(H5Sget_simple_extent_ndims(space));
+		H5Sget_simple_extent_dims(space, dims.data(), NULL);
+		return dims;
+	}
+	/// @brief Get the number of bytes the dataset occupies on disk
+	hsize_t storage_size() const { return H5Dget_storage_size(*this); }
+	/// @brief Read the entire dataset into a flat, row-major buffer
+	template <typename T>
+	void read(std::vector<T> &data) const
+	{
+		hsize_t size = 1;
+		for (hsize_t d : shape())
+			size *= d;
+		data.resize(size);
+		if (H5Dread(*this, get_datatype(T()), H5S_ALL, H5S_ALL, H5P_DEFAULT, data.data()) < 0)
+			throw std::runtime_error("Couldn't read dataset");
+	}
 	/// @brief Write data to dataset
 	template <typename T>
 	void write(const T& data)
 	{
 		Datatype dtype(get_datatype(data));
-		Dataspace dspace(get_shape(data));
+		Dataspace dspace(get_memory_space(data));
 		// TODO: check return value
 		H5Dwrite(*this, dtype, dspace, H5S_ALL, H5P_DEFAULT, get_data(data));
 	}
@@ -362,27 +422,32 @@ public:
 	}
 	
 	template <typename T>
-	Dataset create_carray(const std::string &where, const std::string &name, const T& object, bool overwrite=false)
+	Dataset create_carray(const std::string &where, const std::string &name, const T& object, bool overwrite=false,
+	    const FilterOptions &filters=FilterOptions())
 	{
 		Group group(H5Gopen(*this, where.c_str(), H5P_DEFAULT), H5Gclose);
-		return create_carray(group, name, object, overwrite);
+		return create_carray(group, name, object, overwrite, filters);
 	}
 	/// @brief Create a chunked, compressed array
 	/// @param[in] where parent group
 	/// @param[in] name name of array
 	/// @param[in] object object to store. This determines the type and shape of the resulting array
 	/// @param[in] overwrite overwrite the existing dataset
+	/// @param[in] filters chunking and compression settings
 	template <typename T>
-	Dataset create_carray(Group where, const std::string &name, const T& object, bool overwrite=false)
+	Dataset create_carray(Group where, const std::string &name, const T& object, bool overwrite=false,
+	    const FilterOptions &filters=FilterOptions())
 	{
 		
 		Dataspace dspace(get_shape(object));
 		Datatype dtype(get_datatype(object));
 		
 		DatasetCreationProperties plist;
-		plist.set_chunk(get_chunk_shape(object));
-		plist.set_shuffle();
-		plist.set_deflate(6);
+		plist.set_chunk(get_chunk_shape(object, filters.max_chunk_size));
+		if (filters.shuffle)
+			plist.set_shuffle();
+		if (filters.complevel > 0)
+			plist.set_deflate(filters.complevel);
 		
 		if (overwrite) {
 			mute_errors muzzle;
@@ -395,6 +460,39 @@ public:
 		return dataset;
 	}
 	
+	/// @brief Open an existing dataset
+	/// @param[in] where parent group
+	/// @param[in] name name of array
+	Dataset open_dataset(const std::string &where, const std::string &name)
+	{
+		Group group(H5Gopen(*this, where.c_str(), H5P_DEFAULT), H5Gclose);
+		return Dataset(group, name);
+	}
+	
+	/// @brief Write all buffered data to disk
+	void flush() { H5Fflush(*this, H5F_SCOPE_GLOBAL); }
+	
+	/// @brief Get the current size of the file in bytes
+	hsize_t size() const
+	{
+		hsize_t size = 0;
+		H5Fget_filesize(*this, &size);
+		return size;
+	}
+	
+	/// @brief Get a copy of the file as it would be written to disk
+	std::vector<char> image()
+	{
+		H5Fflush(*this, H5F_SCOPE_GLOBAL);
+		ssize_t size = H5Fget_file_image(*this, NULL, 0);
+		if (size < 0)
+			throw std::runtime_error("Couldn't get file image");
+		std::vector<char> buffer(size);
+		if (H5Fget_file_image(*this, buffer.data(), buffer.size()) < 0)
+			throw std::runtime_error("Couldn't get file image");
+		return buffer;
+	}
+	
 private:
 	Group get_group(const std::string &where)
 	{
@@ -445,6 +543,55 @@ File open_file(const std::string &fname, File::access mode=File::read)
 	return File(id, H5Fclose);
 }
 
+/// @brief Open a file that is held entirely in memory (the HDF5 core driver)
+///
+/// Reading loads the whole file with one sequential read, and the many
+/// small metadata writes of building a file go to memory. With a backing
+/// store the image is written to fname in one pass when the file is
+/// flushed or closed; without one, fname is only a label and the
+/// contents can be retrieved with File::image().
+/// @param[in] fname         path of the backing file
+/// @param[in] mode          as for open_file()
+/// @param[in] backing_store write the image to fname
+/// @param[in] increment     size in bytes by which to grow the image
+File open_memory_file(const std::string &fname, File::access mode=File::write,
+    bool backing_store=true, size_t increment=size_t(1)<<20)
+{
+	FileAccessProperties fapl;
+	fapl.set_core(increment, backing_store);
+	mute_errors muzzle;
+	hid_t id;
+	if (mode == File::read) {
+		id = H5Fopen(fname.c_str(), H5F_ACC_RDONLY, fapl);
+	} else if (mode == File::write) {
+		id = H5Fcreate(fname.c_str(), H5F_ACC_TRUNC, H5P_DEFAULT, fapl);
+	} else {
+		id = H5Fopen(fname.c_str(), H5F_ACC_RDWR, fapl);
+		if (id < 0) {
+			H5Eclear2(H5E_DEFAULT);
+			id = H5Fcreate(fname.c_str(), H5F_ACC_TRUNC, H5P_DEFAULT, fapl);
+		}
+	}
+	if (id < 0) {
+		throw std::runtime_error("Couldn't create file");
+	}
+	return File(id, H5Fclose);
+}
+
+/// @brief Open a copy of a file image, e.g. from File::image(), for reading
+File open_file_image(const void *data, size_t size)
+{
+	FileAccessProperties fapl;
+	fapl.set_core(size_t(1)<<20, false);
+	fapl.set_file_image(data, size);
+	mute_errors muzzle;
+	hid_t id = H5Fopen("image", H5F_ACC_RDONLY, fapl);
+	if (id < 0) {
+		throw std::runtime_error("Couldn't open file image");
+	}
+	return File(id, H5Fclose);
+}
+
 }
 
 #endif // SIMPLE_HDF5_H_INCLUDED